@@ -0,0 +1,646 @@
+// Stress benchmarks for the simulation and draw paths.
+//
+// Builds on top of main.c so every do_* and draw_* function can be timed on
+// its own. Rendering goes through SDL's software renderer on the dummy
+// video driver unless --video is given. Results are printed as JSON and can
+// be checked against a previous run with --baseline.
+//
+// With --golden, a few frames of every scenario are also rendered offscreen
+// by the software renderer and compared against reference images, so a
+// faster draw path can be shown to still draw the same picture.
+
+#define TIGER_NO_MAIN
+#include "main.c"
+
+#define BENCH_TICKS 300
+#define BENCH_THRESHOLD 10.0
+// Frames checked per scenario, evenly spread over its ticks
+#define GOLDEN_FRAMES 3
+// Largest difference in any channel a pixel may have from the reference
+#define GOLDEN_TOLERANCE 2
+
+typedef struct {
+    const char* name;
+    void (*fn)(void);
+    // Still run in scenarios that only want the scenery
+    int scenery;
+} BenchSubsystem;
+
+typedef struct {
+    const char* name;
+    // Called once after the stage is reset, then before every tick
+    void (*setup)(void);
+    void (*sustain)(void);
+    int sceneryOnly;
+    // Kill the player for good or reset the stage like tick() does
+    int resets;
+} BenchScenario;
+
+typedef struct {
+    double mean;
+    double p50;
+    double p99;
+} BenchResult;
+
+typedef struct {
+    // Reference images live here, named after scenario and tick
+    const char* dir;
+    // Write the references instead of checking against them
+    int update;
+    int tolerance;
+    SDL_Texture* target;
+    SDL_Surface* frame;
+    int failures;
+} BenchGolden;
+
+static void bench_bullets(void);
+static void bench_enemy_bullets(void);
+static void bench_explosions(void);
+static void bench_debris(void);
+static void bench_snapshot(void);
+
+static const BenchSubsystem subsystems[] = {
+    { "do_background", do_background, 1 },
+    { "do_starfield", do_starfield, 1 },
+    { "do_player", do_player, 0 },
+    { "do_enemies", do_enemies, 0 },
+    { "do_bullets", bench_bullets, 0 },
+    { "do_enemy_bullets", bench_enemy_bullets, 0 },
+    { "do_explosions", bench_explosions, 0 },
+    { "do_debris", bench_debris, 0 },
+    { "spawn_enemy", spawn_enemy, 0 },
+    { "snapshot", bench_snapshot, 1 },
+    { "prepare_scene", prepare_scene, 1 },
+    { "draw_background", draw_background, 1 },
+    { "draw_startfield", draw_startfield, 1 },
+    { "draw_player", draw_player, 0 },
+    { "draw_bullets", draw_bullets, 0 },
+    { "draw_enemy_bullets", draw_enemy_bullets, 0 },
+    { "draw_enemy", draw_enemy, 0 },
+    { "draw_debris", draw_debris, 0 },
+    { "draw_explosions", draw_explosions, 0 },
+    { "draw_hud", draw_hud, 0 },
+    { "present_scene", present_scene, 1 },
+};
+
+#define BENCH_SUBSYSTEMS ((int)(sizeof(subsystems) / sizeof(subsystems[0])))
+
+static Entity* bench_entity(int kind, int sprite) {
+    Entity* e = entity_spawn(entity_store(kind));
+
+    e->sprite = sprite;
+    e->w = Game.graphics->atlas.sprites[sprite].rect.w;
+    e->h = Game.graphics->atlas.sprites[sprite].rect.h;
+    e->heath = 1;
+
+    return e;
+}
+
+// The steps logic() spreads over the job system, each joined on its own
+
+static void bench_bullets(void) {
+    SDL_atomic_t pending = { 0 };
+    BulletPass* pass = &Game.entities.player_bullets;
+
+    bullets_begin(pass, entity_store(ENT_PLAYER_BULLET), &Game.entities.enemy_grid, entity_store(ENT_ENEMY), SDL_TRUE);
+    Game.jobs->parallel_for(&pending, bullets_job, pass, pass->count, JOB_GRAIN_BULLETS);
+    Game.jobs->wait(&pending);
+    bullets_resolve(pass, bullet_hit_enemy, player_bullet_gone);
+}
+
+static void bench_enemy_bullets(void) {
+    SDL_atomic_t pending = { 0 };
+    BulletPass* pass = &Game.entities.enemy_bullets;
+
+    bullets_begin(pass, entity_store(ENT_ENEMY_BULLET), &Game.entities.player_grid, entity_store(ENT_PLAYER),
+        get_player() != NULL);
+    Game.jobs->parallel_for(&pending, bullets_job, pass, pass->count, JOB_GRAIN_BULLETS);
+    Game.jobs->wait(&pending);
+    bullets_resolve(pass, bullet_hit_player, enemy_bullet_gone);
+}
+
+static void bench_particles(Particles* p) {
+    SDL_atomic_t pending = { 0 };
+    int count = p->count;
+
+    Game.jobs->parallel_for(&pending, particles_job, p, count, JOB_GRAIN_PARTICLES);
+    Game.jobs->wait(&pending);
+    particles_update(p, count);
+}
+
+static void bench_explosions(void) {
+    bench_particles(&Game.scenary.explosions);
+}
+
+static void bench_debris(void) {
+    bench_particles(&Game.scenary.debris);
+}
+
+// What the simulation thread hands the renderer after every tick
+static void bench_snapshot(void) {
+    snapshot_publish();
+    snapshot_acquire();
+}
+
+static void setup_empty(void) {
+    // No enemies ever spawn
+    enemySpawnTimer = 1 << 30;
+}
+
+static void setup_starfield(void) {
+    setup_empty();
+}
+
+// Stationary enemies all over the field, the player firing into them
+static void sustain_enemies(void) {
+    int margin = Game.graphics->atlas.sprites[SPR_PLAYER].rect.w;
+    Entity* e;
+    int n;
+
+    Game.input->held[SDL_SCANCODE_F] = 1;
+
+    for (n = entity_store(ENT_ENEMY)->count; n < 10000; n++) {
+        e = bench_entity(ENT_ENEMY, SPR_ENEMY);
+        e->x = e->prevX = margin + rng_next() % (SCREEN_W - e->w - margin);
+        e->y = e->prevY = rng_next() % (SCREEN_H - e->h);
+        e->reload = rng_next() % (FPS * 2);
+    }
+}
+
+static void sustain_enemy_bullets(void) {
+    Entity* b;
+    int n;
+
+    for (n = entity_store(ENT_ENEMY_BULLET)->count; n < 50000; n++) {
+        b = bench_entity(ENT_ENEMY_BULLET, SPR_ENEMY_BULLET);
+        b->x = b->prevX = rng_next() % SCREEN_W;
+        b->y = b->prevY = rng_next() % SCREEN_H;
+        b->dx = (rng_next() % 11) - 5;
+        b->dy = (rng_next() % 11) - 5;
+    }
+}
+
+static void sustain_explosions(void) {
+    Entity e = { 0 };
+    int i;
+
+    e.sprite = SPR_ENEMY;
+    e.w = Game.graphics->atlas.sprites[SPR_ENEMY].rect.w;
+    e.h = Game.graphics->atlas.sprites[SPR_ENEMY].rect.h;
+
+    // Sixteen kills a tick
+    for (i = 0; i < 16; i++) {
+        e.x = rng_next() % SCREEN_W;
+        e.y = rng_next() % SCREEN_H;
+        add_explosions(e.x, e.y, 32);
+        add_debris(&e);
+    }
+}
+
+// Starts from the state a fresh game with the replay's seed starts from
+static void setup_replay(void) {
+    rng_seed(Game.replay->seed);
+    backgroundX = 0;
+    highscore = 0;
+    Game.stage->reset_stage();
+}
+
+static const BenchScenario scenarios[] = {
+    { "empty", setup_empty, NULL, 0, 0 },
+    { "enemies_10k", setup_empty, sustain_enemies, 0, 0 },
+    { "enemy_bullets_50k", setup_empty, sustain_enemy_bullets, 0, 0 },
+    { "mass_explosions", setup_empty, sustain_explosions, 0, 0 },
+    { "starfield", setup_starfield, NULL, 1, 0 },
+};
+
+// Plays a recorded session, see --replay
+static const BenchScenario replayScenario = { "replay", setup_replay, NULL, 0, 1 };
+
+#define BENCH_SCENARIOS ((int)(sizeof(scenarios) / sizeof(scenarios[0])))
+
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static BenchResult summarize(double* samples, int n) {
+    BenchResult result = { 0, 0, 0 };
+    int i;
+
+    for (i = 0; i < n; i++) {
+        result.mean += samples[i];
+    }
+    result.mean /= n;
+
+    qsort(samples, n, sizeof(double), compare_double);
+    result.p50 = samples[n / 2];
+    result.p99 = samples[MIN(n - 1, n * 99 / 100)];
+
+    return result;
+}
+
+static void golden_init(BenchGolden* golden) {
+    golden->target = SDL_CreateTexture(Game.screen->renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_TARGET, SCREEN_W, SCREEN_H);
+    golden->frame = SDL_CreateRGBSurfaceWithFormat(0, SCREEN_W, SCREEN_H, 32, SDL_PIXELFORMAT_RGBA32);
+    if (golden->target == NULL || golden->frame == NULL) {
+        printf("Failed to create golden frame! SDL Error %s\n", SDL_GetError());
+        exit(1);
+    }
+}
+
+static void golden_destroy(BenchGolden* golden) {
+    SDL_DestroyTexture(golden->target);
+    SDL_FreeSurface(golden->frame);
+    golden->target = NULL;
+    golden->frame = NULL;
+}
+
+static int golden_due(int t, int ticks) {
+    int k;
+
+    for (k = 1; k <= GOLDEN_FRAMES; k++) {
+        if (t + 1 == ticks * k / GOLDEN_FRAMES) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Counts the pixels that differ from the reference by more than the
+// tolerance in any channel, -1 when the reference has another size
+static int golden_compare(BenchGolden* golden, SDL_Surface* reference, int* worst) {
+    SDL_Surface* frame = golden->frame;
+    Uint8 *a, *b;
+    int x, y, c, diff, over, off = 0;
+
+    *worst = 0;
+
+    if (reference->w != frame->w || reference->h != frame->h) {
+        return -1;
+    }
+
+    for (y = 0; y < frame->h; y++) {
+        a = (Uint8*)frame->pixels + y * frame->pitch;
+        b = (Uint8*)reference->pixels + y * reference->pitch;
+
+        for (x = 0; x < frame->w * 4; x += 4) {
+            for (c = 0, over = 0; c < 4; c++) {
+                diff = abs(a[x + c] - b[x + c]);
+                *worst = MAX(*worst, diff);
+                over |= diff > golden->tolerance;
+            }
+            off += over;
+        }
+    }
+
+    return off;
+}
+
+// Renders the snapshot the draw functions just drew into the offscreen
+// target and reads it back. The time includes the read back, the software
+// renderer only rasterizes once it has to hand out pixels.
+static void golden_frame(BenchGolden* golden, const char* scenario, int tick) {
+    SDL_Renderer* renderer = Game.screen->renderer;
+    SDL_Surface *loaded, *reference;
+    char filename[512];
+    Uint64 start;
+    double ms;
+    int off, worst;
+
+    snprintf(filename, sizeof(filename), "%s/%s_%05d.bmp", golden->dir, scenario, tick);
+
+    start = SDL_GetPerformanceCounter();
+
+    SDL_SetRenderTarget(renderer, golden->target);
+    prepare_scene();
+    draw();
+    Game.graphics->flush();
+    if (SDL_RenderReadPixels(renderer, NULL, SDL_PIXELFORMAT_RGBA32, golden->frame->pixels, golden->frame->pitch) != 0) {
+        printf("Failed to read back frame! SDL Error %s\n", SDL_GetError());
+        exit(1);
+    }
+    SDL_SetRenderTarget(renderer, NULL);
+
+    ms = (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+
+    if (golden->update) {
+        if (SDL_SaveBMP(golden->frame, filename) != 0) {
+            printf("Failed to write %s! SDL Error %s\n", filename, SDL_GetError());
+            exit(1);
+        }
+        fprintf(stderr, "golden %-18s tick %5d render %8.3f ms written %s\n", scenario, tick, ms, filename);
+        return;
+    }
+
+    loaded = SDL_LoadBMP(filename);
+    if (loaded == NULL) {
+        fprintf(stderr, "golden %-18s tick %5d render %8.3f ms no reference %s, run with --update FAIL\n",
+            scenario, tick, ms, filename);
+        golden->failures++;
+        return;
+    }
+
+    reference = SDL_ConvertSurfaceFormat(loaded, SDL_PIXELFORMAT_RGBA32, 0);
+    SDL_FreeSurface(loaded);
+    if (reference == NULL) {
+        printf("Failed to convert %s! SDL Error %s\n", filename, SDL_GetError());
+        exit(1);
+    }
+
+    off = golden_compare(golden, reference, &worst);
+    SDL_FreeSurface(reference);
+
+    if (off < 0) {
+        fprintf(stderr, "golden %-18s tick %5d render %8.3f ms reference %s has another size FAIL\n",
+            scenario, tick, ms, filename);
+    } else {
+        fprintf(stderr, "golden %-18s tick %5d render %8.3f ms pixels off %6d max diff %3d%s\n",
+            scenario, tick, ms, off, worst, off > 0 ? " FAIL" : "");
+    }
+
+    if (off != 0) {
+        golden->failures++;
+    }
+}
+
+// Times every subsystem of one scenario, results are in microseconds
+static Uint32 run_scenario(const BenchScenario* scenario, int ticks, BenchResult* results, BenchGolden* golden) {
+    double* samples;
+    double toMicros = 1000000.0 / SDL_GetPerformanceFrequency();
+    Uint64 start;
+    Entity* player;
+    int t, i;
+
+    samples = malloc(sizeof(double) * ticks * BENCH_SUBSYSTEMS);
+    if (samples == NULL) {
+        printf("Failed to allocate benchmark samples!\n");
+        exit(1);
+    }
+
+    rng_seed(1);
+    memset(Game.input->held, 0, sizeof(Game.input->held));
+    Game.stage->reset_stage();
+    scenario->setup();
+
+    for (t = 0; t < ticks; t++) {
+        if (scenario->sustain) {
+            scenario->sustain();
+        }
+
+        input_sample();
+
+        player = get_player();
+        if (player != NULL && player->heath <= 0) {
+            entity_kill(entity_store(ENT_PLAYER), player);
+        }
+
+        if (scenario->resets && get_player() == NULL && --stageResetTimer <= 0) {
+            Game.stage->reset_stage();
+        }
+
+        for (i = 0; i < BENCH_SUBSYSTEMS; i++) {
+            if (scenario->sceneryOnly && !subsystems[i].scenery) {
+                samples[i * ticks + t] = 0;
+                continue;
+            }
+
+            start = SDL_GetPerformanceCounter();
+            subsystems[i].fn();
+            samples[i * ticks + t] = (SDL_GetPerformanceCounter() - start) * toMicros;
+        }
+
+        if (golden != NULL && golden_due(t, ticks)) {
+            golden_frame(golden, scenario->name, t + 1);
+        }
+    }
+
+    for (i = 0; i < BENCH_SUBSYSTEMS; i++) {
+        results[i] = summarize(&samples[i * ticks], ticks);
+    }
+
+    free(samples);
+
+    // Same seed and ticks must always end in the same state
+    return state_hash();
+}
+
+static void write_json(FILE* out, const BenchScenario** run, int runs,
+    BenchResult results[][BENCH_SUBSYSTEMS], Uint32* hashes, int ticks) {
+    int s, i;
+
+    fprintf(out, "{\n  \"ticks\": %d,\n  \"scenarios\": [\n", ticks);
+
+    for (s = 0; s < runs; s++) {
+        fprintf(out, "    { \"name\": \"%s\", \"hash\": \"%08x\", \"subsystems\": {\n",
+            run[s]->name, hashes[s]);
+
+        for (i = 0; i < BENCH_SUBSYSTEMS; i++) {
+            fprintf(out, "      \"%s\": { \"mean_us\": %.3f, \"p50_us\": %.3f, \"p99_us\": %.3f }%s\n",
+                subsystems[i].name, results[s][i].mean, results[s][i].p50, results[s][i].p99,
+                i + 1 < BENCH_SUBSYSTEMS ? "," : "");
+        }
+
+        fprintf(out, "    } }%s\n", s + 1 < runs ? "," : "");
+    }
+
+    fprintf(out, "  ]\n}\n");
+}
+
+static char* read_file(const char* filename) {
+    FILE* file;
+    char* data;
+    long size;
+
+    file = fopen(filename, "rb");
+    if (file == NULL) {
+        printf("Failed to open %s!\n", filename);
+        exit(1);
+    }
+
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    data = malloc(size + 1);
+    if (data == NULL || fread(data, 1, size, file) != (size_t)size) {
+        printf("Failed to read %s!\n", filename);
+        exit(1);
+    }
+    data[size] = '\0';
+
+    fclose(file);
+    return data;
+}
+
+// Finds a subsystem's mean in JSON written by write_json, -1 if missing
+static double baseline_mean(const char* json, const char* scenario, const char* subsystem) {
+    char key[128];
+    const char *start, *end, *found;
+
+    snprintf(key, sizeof(key), "\"name\": \"%s\"", scenario);
+    start = strstr(json, key);
+    if (start == NULL) {
+        return -1;
+    }
+
+    end = strstr(start + 1, "\"name\":");
+
+    snprintf(key, sizeof(key), "\"%s\": { \"mean_us\": ", subsystem);
+    found = strstr(start, key);
+    if (found == NULL || (end != NULL && found > end)) {
+        return -1;
+    }
+
+    return atof(found + strlen(key));
+}
+
+// Prints every subsystem whose mean moved by more than threshold percent and
+// returns how many got slower
+static int compare_baseline(const char* filename, const BenchScenario** run, int runs,
+    BenchResult results[][BENCH_SUBSYSTEMS], double threshold) {
+    char* json = read_file(filename);
+    double base, change;
+    int s, i, regressions = 0;
+
+    fprintf(stderr, "%-18s %-20s %12s %12s %8s\n", "scenario", "subsystem", "base_us", "now_us", "change");
+
+    for (s = 0; s < runs; s++) {
+        for (i = 0; i < BENCH_SUBSYSTEMS; i++) {
+            base = baseline_mean(json, run[s]->name, subsystems[i].name);
+
+            // Too small to measure reliably
+            if (base < 0 || (base < 1 && results[s][i].mean < 1)) {
+                continue;
+            }
+
+            change = base > 0 ? (results[s][i].mean - base) * 100 / base : 100;
+            if (change > threshold || change < -threshold) {
+                fprintf(stderr, "%-18s %-20s %12.3f %12.3f %+7.1f%%%s\n",
+                    run[s]->name, subsystems[i].name, base, results[s][i].mean, change,
+                    change > threshold ? " SLOWER" : "");
+            }
+
+            if (change > threshold) {
+                regressions++;
+            }
+        }
+    }
+
+    free(json);
+    return regressions;
+}
+
+int main(int argc, char* argv[]) {
+    static BenchResult results[BENCH_SCENARIOS][BENCH_SUBSYSTEMS];
+    Uint32 hashes[BENCH_SCENARIOS] = { 0 };
+    const BenchScenario* run[BENCH_SCENARIOS];
+    BenchGolden golden = { .tolerance = GOLDEN_TOLERANCE };
+    const char* outFile = NULL;
+    const char* replay = NULL;
+    const char* baseline = NULL;
+    const char* only = NULL;
+    double threshold = BENCH_THRESHOLD;
+    int ticks = BENCH_TICKS;
+    int video = 0;
+    FILE* out = stdout;
+    int runs = 0;
+    int s, i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--ticks") == 0 && i + 1 < argc) {
+            ticks = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            outFile = argv[++i];
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baseline = argv[++i];
+        } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            threshold = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--scenario") == 0 && i + 1 < argc) {
+            only = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay = argv[++i];
+        } else if (strcmp(argv[i], "--video") == 0) {
+            video = 1;
+        } else if (strcmp(argv[i], "--golden") == 0 && i + 1 < argc) {
+            golden.dir = argv[++i];
+        } else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+            golden.tolerance = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--update") == 0) {
+            golden.update = 1;
+        } else {
+            printf("Usage: %s [--ticks N] [--scenario NAME | --replay FILE] [--out FILE] [--baseline FILE] [--threshold PERCENT] [--video]"
+                " [--golden DIR [--update] [--tolerance N]]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    // A replay runs alone and for as long as it was recorded
+    if (replay != NULL) {
+        replay_play(replay);
+        ticks = Game.replay->ticks;
+        run[runs++] = &replayScenario;
+    }
+
+    for (s = 0; replay == NULL && s < BENCH_SCENARIOS; s++) {
+        if (only == NULL || strcmp(only, scenarios[s].name) == 0) {
+            run[runs++] = &scenarios[s];
+        }
+    }
+
+    if (ticks < 1) {
+        ticks = 1;
+    }
+
+    // Reference images only hold for the software renderer
+    if (!video || golden.dir != NULL) {
+        SDL_setenv("SDL_VIDEODRIVER", "dummy", 1);
+        SDL_setenv("SDL_AUDIODRIVER", "dummy", 1);
+        SDL_SetHint(SDL_HINT_RENDER_DRIVER, "software");
+    }
+
+    Game.init();
+    atexit(Game.quit);
+
+    Game.sounds->init_sounds();
+    Game.stage->init_stage();
+    Game.alpha = 1;
+
+    if (golden.dir != NULL) {
+        golden_init(&golden);
+    }
+
+    for (s = 0; s < runs; s++) {
+        fprintf(stderr, "Running %s...\n", run[s]->name);
+        hashes[s] = run_scenario(run[s], ticks, results[s], golden.dir != NULL ? &golden : NULL);
+    }
+
+    if (golden.dir != NULL) {
+        golden_destroy(&golden);
+    }
+
+    if (outFile != NULL) {
+        out = fopen(outFile, "w");
+        if (out == NULL) {
+            printf("Failed to open %s!\n", outFile);
+            exit(1);
+        }
+    }
+
+    write_json(out, run, runs, results, hashes, ticks);
+
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    if (baseline != NULL && compare_baseline(baseline, run, runs, results, threshold) > 0) {
+        return 2;
+    }
+
+    if (golden.failures > 0) {
+        fprintf(stderr, "%d golden frame(s) differ\n", golden.failures);
+        return 3;
+    }
+
+    return 0;
+}
@@ -4,20 +4,155 @@
 #define SCREEN_NAME "Tiger Rescue"
 #define FPS 60
 
+// The simulation ticks FPS times a second no matter how fast frames are drawn
+#define MAX_TICKS_PER_FRAME 5
+#define MAX_RENDER_FPS 240
+
 #define PLAYER_SPEED          4
 #define PLAYER_BULLET_SPEED   16
 #define ENEMY_BULLET_SPPED    5
 
 #define MAX_KEYBOARD_KEYS 350
 
+// Atlas pages are at most this wide and tall, less if the renderer says so
+#define ATLAS_PAGE_SIZE 2048
+#define ATLAS_MAX_PAGES 4
+#define ATLAS_PADDING 1
+
+// The packer and the game open the mixer the same way, so the sounds baked
+// into the asset pack can be played as they are
+#define AUDIO_FREQUENCY 44100
+#define AUDIO_CHANNELS 2
+#define AUDIO_CHUNK_SIZE 1024
+
+// Asset pack baked by pack.c, loose files in gfx/ and sfx/ are used without it
+#define ASSET_PACK "assets.pak"
+#define STAGE_MUSIC "music/Mercury.ogg"
+#define PACK_MAGIC "TGPK"
+#define PACK_VERSION 1
+#define PACK_ALIGN 16
+
+// Quads a sprite batch holds before it has to flush
+#define BATCH_MAX_QUADS 8192
+// Distinct textures and blend modes the batch keys can tell apart, and
+// distinct pairs of them in all layers plus the commands of DRAW_IN_ORDER
+// layers
+#define DRAW_MAX_TEXTURES 256
+#define DRAW_MAX_BLENDS 16
+#define DRAW_MAX_STATES 256
+// Bits of a draw key holding the order its state was first drawn in
+#define DRAW_ORDER_MASK 0xFF0000u
+
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
 
 #define MAX_STARS 500
+#define STAR_SPEEDS 8
+
+// Entity handles keep the slot in the low ENTITY_INDEX_BITS and the slot's
+// generation above, which changes every time the slot's entity is killed.
+// Stores reserve ENTITY_RESERVE up front and double when they fill up.
+#define ENTITY_INDEX_BITS 20
+#define ENTITY_INDEX_MASK ((1u << ENTITY_INDEX_BITS) - 1)
+#define ENTITY_GENERATIONS (1u << (32 - ENTITY_INDEX_BITS))
+#define ENTITY_RESERVE 512
+
+// Initial particle capacity; particle arrays double when they fill up
+#define PARTICLE_RESERVE_EXPLOSIONS 4096
+#define PARTICLE_RESERVE_DEBRIS 512
+#define DEBRIS_GRAVITY 0.5f
+
+// Snapshot quads reserved up front, one for every entity and particle the
+// stores reserve
+#define SNAPSHOT_RESERVE (ENT_MAX * ENTITY_RESERVE + PARTICLE_RESERVE_EXPLOSIONS + PARTICLE_RESERVE_DEBRIS)
+
+// Collision broadphase cells, in pixels, covering the screen
+#define GRID_CELL 64
+#define GRID_COLS ((SCREEN_W + GRID_CELL - 1) / GRID_CELL)
+#define GRID_ROWS ((SCREEN_H + GRID_CELL - 1) / GRID_CELL)
+#define GRID_RESERVE 1024
+
+// Worker threads are one less than the CPU count, up to JOB_MAX_WORKERS
+// with the main thread. A parallel_for never cuts slices smaller than its
+// grain, below that it runs inline.
+#define JOB_MAX_WORKERS 16
+#define JOB_QUEUE_SIZE 1024
+#define JOB_GRAIN_BULLETS 1024
+#define JOB_GRAIN_PARTICLES 4096
+
+// Replay files start with this and a format version
+#define REPLAY_MAGIC "TGRP"
+#define REPLAY_VERSION 2
+
+// Every main.c allocation goes through these, tagged with what it is for
+// and counted by line. Blocks carry a MEM_HEADER sized header. Ticks
+// after MEM_WARMUP_TICKS are steady state, which --zero-alloc keeps
+// allocation free.
+#define MEM_ALLOC(tag, size) mem_realloc(tag, NULL, size, __LINE__)
+#define MEM_REALLOC(tag, ptr, size) mem_realloc(tag, ptr, size, __LINE__)
+#define MEM_FREE(ptr) mem_free(ptr)
+#define MEM_HEADER 16
+#define MEM_SITES 64
+#define MEM_WARMUP_TICKS (FPS * 5)
+
+// Flag on Snapshots.middle
+#define SNAPSHOT_FRESH 4
+
+// Rewind keeps a frame of state for each of the last REWIND_SECONDS of
+// ticks, as many of them as fit in REWIND_BYTES. Holding the rewind key
+// steps back REWIND_SPEED ticks a tick.
+#define REWIND_SECONDS 10
+#define REWIND_TICKS (REWIND_SECONDS * FPS)
+#define REWIND_BYTES (64 * 1024 * 1024)
+#define REWIND_SPEED 2
+#define REWIND_ALIGN(n) (((n) + 7) & ~(Uint32)7)
+
+// Frames the profiler keeps, and how far over one tick a frame has to run
+// before the overlay lists it as slow
+#define PROFILE_FRAMES 256
+#define PROFILE_SLOW_MS (1250.0 / FPS)
+#define PROFILE_SLOW_SHOWN 4
+#define PROFILE_GRAPH_H 100
+
+// Times one statement into a profiler zone
+#define PROFILE_ZONE(zone, stmt) do { profile_begin(zone); stmt; profile_end(zone); } while (0)
+
+// Lines of the renderer stats overlay
+#define RENDER_STATS_LINES 4
 
 #define MAX_SND_CHANNELS 8
 
+// Requests for the same sound within a tick play as one voice. A single
+// request plays at SND_VOLUME, below full so SDL_mixer's channels have
+// headroom, and each repeat adds SND_MERGE_GAIN. That stops at full
+// volume on SDL_mixer's channels, the --mixer engine saturates and goes
+// on up to SND_MERGE_MAX_VOLUME.
+#define SND_VOLUME (MIX_MAX_VOLUME * 3 / 4)
+#define SND_MERGE_GAIN 12
+#define SND_MERGE_MAX_VOLUME (MIX_MAX_VOLUME * 3 / 2)
+// At most this many voices start per tick, highest priority first, the
+// rest are dropped. The MAX_SND_CHANNELS channels are shared by every
+// voice still playing and effects last many ticks, so the budget keeps
+// one tick's burst from taking them all. A start that finds them all
+// busy is dropped too.
+#define SND_VOICE_BUDGET 3
+// Effects still playing when a rewind starts fade down to this
+#define SND_REWIND_VOLUME (MIX_MAX_VOLUME / 4)
+
+// Voices of the --mixer engine, the first CH_MAX belong to the named
+// channels. Commands that find the ring full are dropped.
+#define AUDIO_VOICES MAX_SND_CHANNELS
+#define AUDIO_RING_SIZE 256
+
 #define GLYPH_H 28
 #define GLYPH_W 18
 #define MAX_LINE_LENGTH 1024
+#define TEXT_CACHE_SIZE 16
+// Glyphs every text run is allocated with at startup, a line across the
+// whole screen. Lines that fit on screen never grow a run.
+#define TEXT_RUN_MIN (SCREEN_W / GLYPH_W + 1)
+// The HUD layer holds the two score lines one above the other, wide
+// enough for "HIGH SCORE: " and the ten digits of any score
+#define HUD_LAYER_W (22 * GLYPH_W)
+#define HUD_LAYER_H (2 * GLYPH_H)
 
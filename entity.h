@@ -0,0 +1,7 @@
+enum {
+    ENT_PLAYER,
+    ENT_PLAYER_BULLET,
+    ENT_ENEMY,
+    ENT_ENEMY_BULLET,
+    ENT_MAX
+};
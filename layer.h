@@ -0,0 +1,33 @@
+enum {
+    LAYER_PLAYER,
+    LAYER_BULLETS,
+    LAYER_ENEMY_BULLETS,
+    LAYER_ENEMIES,
+    LAYER_DEBRIS,
+    LAYER_EXPLOSIONS,
+    LAYER_MAX
+};
+
+// Layers kept in render targets of their own and composited every frame,
+// they are only redrawn when what they show changes
+enum {
+    CACHE_STARS,
+    CACHE_HUD = CACHE_STARS + STAR_SPEEDS,
+    CACHE_MAX
+};
+
+// Order the renderer draws in, recorded quads are sorted by it first
+enum {
+    DRAW_BACKGROUND,
+    DRAW_STARFIELD,
+    DRAW_SNAPSHOT,
+    DRAW_HUD = DRAW_SNAPSHOT + LAYER_MAX,
+    DRAW_OVERLAY,
+    DRAW_MAX
+};
+
+// Layers whose quads pile up on each other whatever they are drawn with.
+// Their commands go out in the order they were recorded, other layers
+// have their quads grouped by state.
+#define DRAW_IN_ORDER (1u << (DRAW_SNAPSHOT + LAYER_DEBRIS) | 1u << (DRAW_SNAPSHOT + LAYER_EXPLOSIONS) \
+    | 1u << DRAW_HUD | 1u << DRAW_OVERLAY)
@@ -14,6 +14,20 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <time.h>
+
+#if defined(__SSE__)
+#include <immintrin.h>
+#endif
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #define SDL_MAIN_HANDLEd
 #include "SDL2/SDL.h"
@@ -29,24 +43,95 @@ void prepare_scene(void);
 void present_scene(void);
 void game_quit(void);
 
-static SDL_Texture* load_texture(const char*);
-static int  bullet_hit_enemy(Entity*);
-static int  bullet_hit_player(Entity*);
+static SDL_Surface* load_surface(const char*);
+static void load_atlas(void);
+static int  atlas_page_size(void);
+static void atlas_pack(int pageSize);
+static SDL_bool atlas_pack_images(SDL_Surface**, int pageSize);
+static void atlas_upload(void);
+static void atlas_destroy(void);
+static SDL_BlendMode sprite_blend(int);
+static SDL_bool pack_open(void);
+static void pack_close(void);
+static SDL_bool pack_load_atlas(void);
+static SDL_bool pack_load_sounds(void);
+static void bullet_hit_enemy(Entity*, Entity*);
+static void bullet_hit_player(Entity*, Entity*);
+static int  enemy_bullet_gone(Entity*);
+static int  player_bullet_gone(Entity*);
+static void bullets_begin(BulletPass*, EntityStore*, Grid*, EntityStore*, SDL_bool);
+static void bullets_job(void*, int, int);
+static void bullets_resolve(BulletPass*, void (*)(Entity*, Entity*), int (*)(Entity*));
+static void bullets_destroy(BulletPass*);
+static void scenery_job(void*, int, int);
 static int  detect_colision(Entity*, Entity*);
-static void blit(SDL_Texture*, int, int);
-static void blitRect(SDL_Texture*, SDL_Rect*, int, int);
+static void blit(int, int, int);
+static void blitRect(int, SDL_Rect*, int, int);
+static void blitColor(int, SDL_Rect*, int, int, SDL_Color);
+static void batch_init(void);
+static Uint32 batch_key(SpriteBatch*);
+static SpriteBatch* batch_bind(SDL_Texture*, int, int, SDL_BlendMode);
+static SpriteBatch* batch_bind_sprite(Sprite*);
+static void batch_layer(int);
+static void batch_record(SpriteBatch*, int);
+static void batch_quad(SpriteBatch*, const SDL_Rect*, float, float, float, float, SDL_Color);
+static void batch_vertices(SpriteBatch*, const SDL_Vertex*, int, float, float);
+static void make_quad(SDL_Vertex*, const SDL_Rect*, float, float, float, float, SDL_Color, int, int);
+static DrawCommand* batch_sort(SpriteBatch*);
+static void batch_changes(DrawCommand*, int, long*, long*);
+static void batch_flush(void);
+static void print_batch_stats(void);
+static void render_draw(SDL_Texture*, SDL_BlendMode, long);
+static void render_color(Uint8, Uint8, Uint8, Uint8);
+static void render_draw_blend(SDL_BlendMode);
+static int  render_texture_blend(SDL_Texture*, SDL_BlendMode);
+static void render_target(SDL_Texture*);
+static void render_clear(void);
+static void render_fill_rect(const SDL_Rect*);
+static void render_fill_rects(const SDL_Rect*, int);
+static void render_line(int, int, int, int);
+#ifndef TIGER_NO_MAIN
+static void render_rect(const SDL_Rect*);
+#endif
+static void render_geometry(SDL_Texture*, const SDL_Vertex*, int, const int*, int);
+static void render_present(void);
+static void render_stats_frame(void);
+static void render_stats_draw(void);
+static void print_render_stats(void);
 static void calc_slope(int srcX, int srcY, int dstX, int dstY, float *refX, float * refY);
-static void capFrameRate(long*, float*);
-static void do_bullets(void);
+#ifndef TIGER_PACK
+static void rng_seed(Uint32);
+#endif
+static int  rng_next(void);
+static Uint32 state_hash(void);
+#ifndef TIGER_NO_MAIN
+static void capFrameRate(Uint64);
+static void tick(void);
+static void run_headless(long);
+static void replay_record(const char*, Uint32);
+static void sim_start(void);
+static int  sim_thread(void*);
+static void loader_start(void);
+static void loader_frame(void);
+static void loading_logic(void);
+static void loading_draw(void);
+static void load_sprite_job(void*, int, int);
+static void load_audio_job(void*, int, int);
+static void load_atlas_job(void*, int, int);
+static void rewind_load(Uint8*);
+static SDL_bool rewind_restore(int);
+static void rewind_capture(void);
+static SDL_bool rewind_tick(void);
+static void mem_tick(void);
+static void render_stats_open(const char*);
+#endif
+static float lerp(float, float);
 static void do_enemies(void);
-static void do_enemy_bullets(void);
 static void do_key_down(SDL_KeyboardEvent*);
 static void do_key_up(SDL_KeyboardEvent*);
 static void do_player(void);
 static void do_background(void);
 static void do_starfield(void);
-static void do_explosions(void);
-static void do_debris(void);
 static void add_explosions(int x, int y, int num);
 static void add_debris(Entity* e);
 
@@ -65,6 +150,7 @@ static void fire_bullet(void);
 static void fire_enemy_bullet(Entity*);
 static void init_player(void);
 static void init_starfield(void);
+static void render_star_layers(Star*, int);
 static void init_stage(void);
 static void init_sounds(void);
 static void logic(void);
@@ -73,21 +159,178 @@ static void spawn_enemy(void);
 
 static void init_sounds(void);
 static void load_sounds(void);
+static void load_sound_files(void);
+static SDL_bool load_sound(int);
 static void play_sound(int, int);
+static void flush_sounds(void);
+static void stop_sounds(void);
+static void volume_sounds(int);
+static void print_sound_stats(void);
+static void audio_init(void);
+static void audio_quit(void);
+static void audio_send(int type, int channel, int volume, Mix_Chunk*);
+static void audio_mix(void*, Uint8*, int);
+static void audio_mix_voice(Sint16*, const Sint16*, int, int);
 static void load_music(char*);
 static void play_music(int);
 
 static void draw_text(int, int ,int ,int ,int, char*, ...);
+static TextRun* text_run(const char*, SDL_Color);
+static int  text_glyph(int, int);
+static void text_init(void);
+static void text_destroy(void);
+static void print_text_stats(void);
+
+static EntityStore* entity_store(int kind);
+static Entity* entity_spawn(EntityStore*);
+static void    entity_kill(EntityStore*, Entity*);
+static Entity* entity_get(EntityStore*, EntityHandle);
+static void    entity_reserve(EntityStore*, int);
+static void    entity_clear(EntityStore*);
+static void    entity_destroy(EntityStore*);
+static void    print_entity_stats(void);
+static Entity* get_player(void);
+
+static void particles_reserve(Particles*, int);
+static int  particles_emit(Particles*, int);
+static int  particles_integrate(Particles*, int, int);
+static void particles_job(void*, int, int);
+static void particles_update(Particles*, int);
+static void particles_compact(Particles*);
+static void particles_destroy(Particles*);
+
+static void    grid_reserve(Grid*, int);
+static void    grid_build(Grid*, EntityStore*);
+static int     grid_first_hit(Grid*, Entity*, long*);
+static void    grid_count(Grid*, long, int);
+static void    grid_destroy(Grid*);
+static void    print_grid_stats(void);
+
+static void jobs_init(void);
+static void jobs_quit(void);
+static int  jobs_worker(void*);
+static int  jobs_self(void);
+static int  jobs_run_one(int);
+static void jobs_submit(SDL_atomic_t*, JobFunction, void*, int, int);
+static void jobs_parallel_for(SDL_atomic_t*, JobFunction, void*, int, int);
+static void jobs_wait(SDL_atomic_t*);
+
+static void* mem_realloc(int, void*, size_t, int);
+static void mem_free(void*);
+static void print_memory_stats(void);
+static Uint32 rewind_bytes(Uint8*, Uint32, void*, Uint32, SDL_bool);
+static Uint32 rewind_walk(Uint8*, SDL_bool);
+static Uint32 rewind_save(Uint8*);
+static void rewind_mark_start(void);
+static void rewind_quit(void);
+#ifndef TIGER_PACK
+static void input_sample(void);
+static Uint32 replay_play(const char*);
+static void replay_sample(int*);
+#endif
+static void replay_verify(void);
+static void replay_close(void);
+
+static void snapshot_reserve(Snapshot*, int);
+#ifndef TIGER_PACK
+static void snapshot_capture(Snapshot*);
+static void snapshot_push(Snapshot*, int, SDL_Rect*, float, float, float, float, SDL_Color);
+static void snapshot_publish(void);
+static Snapshot* snapshot_acquire(void);
+#endif
+static void snapshot_destroy(void);
+static void sim_stop(void);
+static void sim_fail(void);
+static void draw_layer(int);
+static SDL_bool cache_begin(int, Uint64);
+static void cache_end(void);
+static void cache_draw(int, const SDL_Rect*, float, float);
+static void caches_invalidate(void);
+static void caches_destroy(void);
+static void print_cache_stats(void);
+
+static void profile_begin(int);
+static void profile_end(int);
+static void profile_begin_frame(void);
+static void profile_end_frame(void);
+static void profile_draw(void);
+
 static int highscore;
 
-// Temp
-static SDL_Texture* gPlayerBulletTexture;
-static SDL_Texture* gEnemyTexture;
-static SDL_Texture* gEnemyBulletTexture;
-static SDL_Texture* gPlayerTexture;
-static SDL_Texture* gBackGroundTexture;
-static SDL_Texture* gExplosionTexture;
-static SDL_Texture* gFontTexture;
+static const char* spriteFiles[SPR_MAX] = {
+    [SPR_PLAYER] = "gfx/player.png",
+    [SPR_PLAYER_BULLET] = "gfx/playerBullet.png",
+    [SPR_ENEMY] = "gfx/enemy.png",
+    [SPR_ENEMY_BULLET] = "gfx/enemyBullet.png",
+    [SPR_BACKGROUND] = "gfx/background.png",
+    [SPR_EXPLOSION] = "gfx/explosion.png",
+    [SPR_FONT] = "gfx/font.png",
+};
+
+static const char* soundFiles[SND_MAX] = {
+    [SND_PLAYER_FIRE] = "sfx/334227__jradcoolness__laser.ogg",
+    [SND_ALIEN_FIRE] = "sfx/196914__dpoggioli__laser-gun.ogg",
+    [SND_PLAYER_DIE] = "sfx/245372__quaker540__hq-explosion.ogg",
+    [SND_ALIEND_DIE] = "sfx/10 Guage Shotgun-SoundBible.com-74120584.ogg",
+};
+
+// Which sounds keep their voice when a tick asks for too many
+static const int soundPriority[SND_MAX] = {
+    [SND_PLAYER_DIE] = 3,
+    [SND_PLAYER_FIRE] = 2,
+    [SND_ALIEND_DIE] = 1,
+    [SND_ALIEN_FIRE] = 0,
+};
+
+static const char* zoneNames[ZONE_MAX] = {
+    [ZONE_DO_INPUT] = "input",
+    [ZONE_DO_PLAYER] = "do player",
+    [ZONE_DO_ENEMIES] = "do enemies",
+    [ZONE_SIM_JOBS] = "sim jobs",
+    [ZONE_DO_BULLETS] = "do bullets",
+    [ZONE_DO_ENEMY_BULLETS] = "do enemy bullets",
+    [ZONE_DO_EXPLOSIONS] = "do explosions",
+    [ZONE_DO_DEBRIS] = "do debris",
+    [ZONE_SPAWN_ENEMY] = "spawn enemy",
+    [ZONE_SNAPSHOT] = "snapshot",
+    [ZONE_PREPARE_SCENE] = "prepare scene",
+    [ZONE_DRAW_BACKGROUND] = "draw background",
+    [ZONE_DRAW_STARFIELD] = "draw starfield",
+    [ZONE_DRAW_PLAYER] = "draw player",
+    [ZONE_DRAW_BULLETS] = "draw bullets",
+    [ZONE_DRAW_ENEMY_BULLETS] = "draw enemy bullets",
+    [ZONE_DRAW_ENEMY] = "draw enemy",
+    [ZONE_DRAW_DEBRIS] = "draw debris",
+    [ZONE_DRAW_EXPLOSIONS] = "draw explosions",
+    [ZONE_DRAW_HUD] = "draw hud",
+    [ZONE_PRESENT_SCENE] = "present",
+    [ZONE_CAP_FRAME_RATE] = "frame cap",
+};
+
+static const char* memTagNames[MEM_MAX] = {
+    [MEM_BATCH] = "batch",
+    [MEM_TEXT] = "text",
+    [MEM_ENTITIES] = "entities",
+    [MEM_PARTICLES] = "particles",
+    [MEM_GRID] = "grid",
+    [MEM_BULLETS] = "bullets",
+    [MEM_SNAPSHOTS] = "snapshots",
+    [MEM_REWIND] = "rewind",
+};
+
+// Keys the simulation reads, in bit order of a replay's key mask
+#ifndef TIGER_PACK
+static const SDL_Scancode replayKeys[] = {
+    SDL_SCANCODE_K,
+    SDL_SCANCODE_J,
+    SDL_SCANCODE_H,
+    SDL_SCANCODE_L,
+    SDL_SCANCODE_F,
+};
+#endif
+
+// All gameplay randomness comes from here so a seed reproduces a run
+static Uint32 rngState = 1;
 
 static int backgroundX;
 static int enemySpawnTimer;
@@ -98,8 +341,17 @@ static struct {
     // Define attributes
     SDL_bool running;
 
+    // Run the simulation only, no window, renderer or audio
+    SDL_bool headless;
+    // Stages reset after the player died, only reported
+    long resets;
+
     // track of fps
     float elapsed;
+
+    // How far rendering is between the previous and the current tick, 0..1
+    float alpha;
+    SDL_bool vsync;
     // All window related
     Screen* screen;
 
@@ -108,6 +360,9 @@ static struct {
 
     Sounds* sounds;
 
+    // Worker threads the simulation spreads its independent steps over
+    Jobs* jobs;
+
     Delegate* delegate;
 
     // All input related
@@ -119,12 +374,42 @@ static struct {
     // All drawing text related
     Text* text;
 
+    // Per zone frame timings, F3 shows them
+    Profiler* profiler;
+
+    // Hands each tick's state from the simulation thread to the renderer
+    Snapshots* snapshots;
+
+    // Input recording or playback, see replay_sample
+    Replay* replay;
+
+    // Recent ticks of state to rewind to, see rewind_tick
+    Rewind* rewind;
+
+    // Heap use of everything main.c allocates, see MEM_ALLOC
+    Memory* memory;
+
+    // Own mixer for sound effects when started with --mixer
+    Audio* audio;
+
+    // Pre-decoded assets, see pack_open
+    Pack* pack;
+
+    // Startup asset loading, see loader_start
+    Loader* loader;
+
     //All entities related
     struct {
-        Entity* player;
-        Entity* player_bullet;
-        Entity* enemy;
-        Entity* enemy_bullet;
+        EntityStore stores[ENT_MAX];
+        // Looks up as NULL once the player is killed
+        EntityHandle player;
+
+        // Broadphase for bullets against enemies and against the player
+        Grid enemy_grid;
+        Grid player_grid;
+
+        BulletPass player_bullets;
+        BulletPass enemy_bullets;
 
         int (*detect_colision)(Entity*, Entity*);
         void(*calc_slope)(int srcX, int srcY, int dstX, int dstY, float *refX, float * refY);
@@ -134,6 +419,13 @@ static struct {
     // All gfx related to scenary like stars and explosions
     struct {
         Star stars[MAX_STARS];
+        // Stars of each speed are drawn once into a wrap-around layer, the
+        // layers are then only scrolled. starOffset is each layer's x.
+        int starOffset[STAR_SPEEDS];
+        // Bumped whenever the stars are scattered anew
+        int starGeneration;
+        Particles explosions;
+        Particles debris;
         void (*init_starfield)(void);
     } scenary;
 
@@ -146,7 +438,10 @@ static struct {
 } Game =  {
     SDL_FALSE,
 
+    .headless = SDL_FALSE,
     .elapsed = 0,
+    .alpha = 0,
+    .vsync = SDL_FALSE,
 
     // Screen
     .screen = &(Screen) {
@@ -159,9 +454,17 @@ static struct {
 
     // Graphics
     .graphics = &(Graphics) {
-        load_texture,
-        blit,
-        blitRect
+        .load_atlas = load_atlas,
+        .blit = blit,
+        .blitRect = blitRect,
+        .blitColor = blitColor,
+        .flush = batch_flush,
+        .atlas = {},
+        .batch = {},
+        .caches = {
+            [CACHE_STARS ... CACHE_HUD - 1] = { .name = "stars", .w = SCREEN_W, .h = SCREEN_H },
+            [CACHE_HUD] = { .name = "hud", .w = HUD_LAYER_W, .h = HUD_LAYER_H }
+        }
     },
 
     .sounds = &(Sounds) {
@@ -169,12 +472,22 @@ static struct {
         .init_sounds = init_sounds,
         .load_sounds = load_sounds,
         .play_sound = play_sound,
+        .flush_sounds = flush_sounds,
+        .stop_sounds = stop_sounds,
+        .volume_sounds = volume_sounds,
 
         .music = NULL,
         .load_music = load_music,
         .play_music = play_music
     },
 
+    .jobs = &(Jobs) {
+        .workers = 1,
+        .submit = jobs_submit,
+        .parallel_for = jobs_parallel_for,
+        .wait = jobs_wait
+    },
+
     .delegate = &(Delegate) {
         logic,
         draw,
@@ -190,19 +503,6 @@ static struct {
 
     // Stage
     .stage = &(Stage) {
-        .playerHead =  {},
-        .playerTail = NULL,
-        .playerBulletHead =  {},
-        .playerBulletTail = NULL,
-        .enemyHead =  {},
-        .enemyTail = NULL,
-        .enemyBulletHead = {},
-        .enemyBulletTail = NULL,
-        .explosionHead = {},
-        .explosionTail = NULL,
-        .debrisHead = {},
-        .debrisTail = NULL,
-
         .score = 0,
 
         .reset_stage = reset_stage,
@@ -211,20 +511,72 @@ static struct {
 
     .text = &(Text) {
         .drawTextBuffer = {},
+        .runs = {},
         .draw_text = draw_text,
     },
 
+    .profiler = &(Profiler) {
+        .visible = SDL_FALSE,
+        .begin_frame = profile_begin_frame,
+        .end_frame = profile_end_frame,
+        .draw = profile_draw
+    },
+
+    .replay = &(Replay) {
+        .file = NULL,
+        .recording = SDL_FALSE,
+        .playing = SDL_FALSE
+    },
+
+    .rewind = &(Rewind) {
+        .enabled = SDL_FALSE,
+        .data = NULL,
+        .start = NULL
+    },
+
+    .memory = &(Memory) {
+        .strict = SDL_FALSE,
+        .armed = SDL_FALSE
+    },
+
+    .pack = &(Pack) {
+        .data = NULL,
+        .opened = SDL_FALSE
+    },
+
+    .audio = &(Audio) {
+        .enabled = SDL_FALSE
+    },
+
+    .loader = &(Loader) {
+        .active = SDL_FALSE
+    },
+
+    .snapshots = &(Snapshots) {
+        .middle = { 1 },
+        .back = 2,
+        .front = 0
+    },
+
     .entities = {
-        .player = &(Entity) {},
-        .player_bullet = &(Entity) {},
-        .enemy = &(Entity) {},
+        .stores = {
+            [ENT_PLAYER] = { .name = "player", .freeSlot = -1 },
+            [ENT_PLAYER_BULLET] = { .name = "player bullets", .freeSlot = -1 },
+            [ENT_ENEMY] = { .name = "enemies", .freeSlot = -1 },
+            [ENT_ENEMY_BULLET] = { .name = "enemy bullets", .freeSlot = -1 },
+        },
+        .player = 0,
         .calc_slope = calc_slope,
         .detect_colision = detect_colision
     },
 
     .scenary = {
         .stars = {},
-        init_starfield
+        .starOffset = {},
+        .starGeneration = 0,
+        .explosions = { .gravity = 0 },
+        .debris = { .gravity = DEBRIS_GRAVITY },
+        .init_starfield = init_starfield
     },
 
     game_init,
@@ -236,18 +588,46 @@ static struct {
 
 void game_init(void) {
 
+    if (Game.headless) {
+        if (SDL_Init(SDL_INIT_TIMER) != 0) {
+            printf("Failed to initialize SDL! SDL Error %s\n", SDL_GetError());
+            exit(1);
+        }
+
+        jobs_init();
+
+        Game.running = SDL_TRUE;
+        return;
+    }
+
     if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
         printf("Failed to initialize SDL! SDL Error %s\n", SDL_GetError());
         exit(1);
     };
 
-    if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 1024) == -1) {
+    // Decoders set themselves up on first use unless initialized here,
+    // before the loader decodes on worker threads
+    if ((IMG_Init(IMG_INIT_PNG) & IMG_INIT_PNG) == 0) {
+        printf("Failed to initialize SDL_image! SDL Error %s\n", IMG_GetError());
+        exit(1);
+    }
+
+    if ((Mix_Init(MIX_INIT_OGG) & MIX_INIT_OGG) == 0) {
+        printf("Failed to initialize SDL_mixer! SDL Error %s\n", Mix_GetError());
+        exit(1);
+    }
+
+    if (Mix_OpenAudio(AUDIO_FREQUENCY, MIX_DEFAULT_FORMAT, AUDIO_CHANNELS, AUDIO_CHUNK_SIZE) == -1) {
         printf("Failed to initialize Open Audio! SDL Error %s\n", SDL_GetError());
         exit(1);
     }
 
     Mix_AllocateChannels(MAX_SND_CHANNELS);
 
+    if (Game.audio->enabled) {
+        audio_init();
+    }
+
 
     unsigned int w = Game.screen->w;
     unsigned int h = Game.screen->h;
@@ -275,31 +655,57 @@ void game_init(void) {
         exit(1);
     }
 
+    SDL_RendererInfo info;
+    if (SDL_GetRendererInfo(Game.screen->renderer, &info) == 0) {
+        Game.vsync = (info.flags & SDL_RENDERER_PRESENTVSYNC) ? SDL_TRUE : SDL_FALSE;
+    }
+
+    batch_init();
+    text_init();
+    jobs_init();
+
+    Game.profiler->frequency = SDL_GetPerformanceFrequency();
+    Game.profiler->renderThread = SDL_ThreadID();
+
     Game.running = SDL_TRUE;
 }
 
 void game_quit(void) {
 
-    SDL_DestroyTexture(gPlayerTexture);
-    gPlayerTexture = NULL;
-
-    SDL_DestroyTexture(gPlayerBulletTexture);
-    gPlayerBulletTexture = NULL;
+    int i;
 
-    SDL_DestroyTexture(gEnemyBulletTexture);
-    gEnemyBulletTexture = NULL;
+    sim_stop();
+    jobs_quit();
+    replay_close();
+    rewind_quit();
 
-    SDL_DestroyTexture(gEnemyTexture);
-    gEnemyTexture = NULL;
+    // Sprites decoded by a loader that never got to pack them
+    for (i = 0; i < SPR_MAX; i++) {
+        SDL_FreeSurface(Game.loader->images[i]);
+        Game.loader->images[i] = NULL;
+    }
 
-    SDL_DestroyTexture(gBackGroundTexture);
-    gEnemyTexture = NULL;
+    atlas_destroy();
+    print_text_stats();
+    text_destroy();
 
-    SDL_DestroyTexture(gExplosionTexture);
-    gEnemyTexture = NULL;
+    print_cache_stats();
+    caches_destroy();
 
-    SDL_DestroyTexture(gFontTexture);
-    gFontTexture = NULL;
+    print_batch_stats();
+    print_render_stats();
+    if (Game.graphics->stats.csv != NULL) {
+        fclose(Game.graphics->stats.csv);
+        Game.graphics->stats.csv = NULL;
+    }
+    MEM_FREE(Game.graphics->batch.vertices);
+    MEM_FREE(Game.graphics->batch.indices);
+    MEM_FREE(Game.graphics->batch.commands);
+    MEM_FREE(Game.graphics->batch.sorted);
+    Game.graphics->batch.vertices = NULL;
+    Game.graphics->batch.indices = NULL;
+    Game.graphics->batch.commands = NULL;
+    Game.graphics->batch.sorted = NULL;
 
     SDL_DestroyRenderer(Game.screen->renderer);
     Game.screen->renderer = NULL;
@@ -307,15 +713,41 @@ void game_quit(void) {
     SDL_DestroyWindow(Game.screen->window);
     Game.screen->window = NULL;
 
+    // No callback may touch a chunk once they are freed
+    audio_quit();
+
     Mix_FreeMusic(Game.sounds->music);
     Game.sounds->music = NULL;
 
-    int i;
     for(i = 0; i < SND_MAX; i++) {
         if (Game.sounds->sounds[i] != NULL)
             Mix_FreeChunk(Game.sounds->sounds[i]);
     }
 
+    // Chunks and textures are done with the mapping
+    pack_close();
+
+    print_sound_stats();
+    print_entity_stats();
+    for (i = 0; i < ENT_MAX; i++) {
+        entity_destroy(entity_store(i));
+    }
+
+    particles_destroy(&Game.scenary.explosions);
+    particles_destroy(&Game.scenary.debris);
+
+    print_grid_stats();
+    grid_destroy(&Game.entities.enemy_grid);
+    grid_destroy(&Game.entities.player_grid);
+    bullets_destroy(&Game.entities.player_bullets);
+    bullets_destroy(&Game.entities.enemy_bullets);
+    snapshot_destroy();
+
+    // Anything still live by now leaked
+    print_memory_stats();
+
+    Mix_Quit();
+    IMG_Quit();
     SDL_Quit();
     Game.running = SDL_FALSE;
 }
@@ -334,6 +766,13 @@ void do_input(void) {
             case SDL_KEYDOWN:
                 Game.input->do_key_down(&e.key);
                 break;
+            // Target contents are gone, a lost device takes the textures too
+            case SDL_RENDER_TARGETS_RESET:
+                caches_invalidate();
+                break;
+            case SDL_RENDER_DEVICE_RESET:
+                caches_destroy();
+                break;
             default:
                 break;
         }
@@ -343,109 +782,53 @@ void do_input(void) {
 
 static void init_stage(void) {
 
-    gPlayerTexture = Game.graphics->load_texture("gfx/player.png");
-    if (gPlayerTexture == NULL) {
-        printf("Failed to load player texture! SDL Error %s\n", SDL_GetError());
-        exit(1);
-    }
+    int i;
 
-    gPlayerBulletTexture = Game.graphics->load_texture("gfx/playerBullet.png");
-    if (gPlayerBulletTexture == NULL) {
-        printf("Failed to load bullet texture! SDL Error %s\n", SDL_GetError());
-        exit(1);
+    // The loader may have brought everything in already
+    if (Game.graphics->atlas.pageCount == 0) {
+        Game.graphics->load_atlas();
     }
 
-    gEnemyTexture = Game.graphics->load_texture("gfx/enemy.png");
-    if (gEnemyTexture == NULL) {
-        printf("Failed to load enemy texture! SDL Error %s\n", SDL_GetError());
-        exit(1);
+    if (!Game.headless) {
+        if (Game.sounds->music == NULL) {
+            Game.sounds->load_music(STAGE_MUSIC);
+        }
+        Game.sounds->play_music(1);
     }
 
-    gEnemyBulletTexture = Game.graphics->load_texture("gfx/enemyBullet.png");
-    if (gEnemyBulletTexture == NULL) {
-        printf("Failed to load enemy bullet texture! SDL Error %s\n", SDL_GetError());
-        exit(1);
+    for (i = 0; i < ENT_MAX; i++) {
+        entity_reserve(entity_store(i), ENTITY_RESERVE);
     }
 
-    gBackGroundTexture = Game.graphics->load_texture("gfx/background.png");
-    if (gBackGroundTexture == NULL) {
-      printf("Failed to load background texture! SDL Error %s\n",
-             SDL_GetError());
-      exit(1);
-    }
+    particles_reserve(&Game.scenary.explosions, PARTICLE_RESERVE_EXPLOSIONS);
+    particles_reserve(&Game.scenary.debris, PARTICLE_RESERVE_DEBRIS);
 
-    gExplosionTexture = Game.graphics->load_texture("gfx/explosion.png");
-    if (gExplosionTexture == NULL) {
-      printf("Failed to load explosion texture! SDL Error %s\n",
-             SDL_GetError());
-      exit(1);
-    }
+    grid_reserve(&Game.entities.enemy_grid, GRID_RESERVE);
+    grid_reserve(&Game.entities.player_grid, GRID_RESERVE);
 
-    gFontTexture = Game.graphics->load_texture("gfx/font.png");
-    if (gFontTexture == NULL) {
-      printf("Failed to load font texture! SDL Error %s\n",
-             SDL_GetError());
-      exit(1);
+    // Room for a quad of everything reserved above, before the simulation
+    // thread starts filling them
+    for (i = 0; i < 3; i++) {
+        snapshot_reserve(&Game.snapshots->buffers[i], SNAPSHOT_RESERVE);
     }
 
-    Game.sounds->load_music("music/Mercury.ogg");
-    Game.sounds->play_music(1);
-
     Game.stage->reset_stage();
 
 }
 
 static void reset_stage(void) {
 
-    Entity* e;
-    Explosion* Exp;
-    Debris* Deb;
-
-    while (Game.stage->enemyBulletHead.next) {
-        e = Game.stage->enemyBulletHead.next;
-        Game.stage->enemyBulletHead.next = e->next;
-        free(e);
-    }
-
-    while (Game.stage->enemyHead.next) {
-        e = Game.stage->enemyHead.next;
-        Game.stage->enemyHead.next = e->next;
-        free(e);
-    }
-
-    while (Game.stage->playerBulletHead.next) {
-        e = Game.stage->playerBulletHead.next;
-        Game.stage->playerBulletHead.next = e->next;
-        free(e);
-    }
-
-    while (Game.stage->playerHead.next) {
-        e = Game.stage->playerHead.next;
-        Game.stage->playerHead.next = e->next;
-        free(e);
-    }
+    int i;
 
-    while (Game.stage->explosionHead.next) {
-        Exp = Game.stage->explosionHead.next;
-        Game.stage->explosionHead.next = Exp->next;
-        free(Exp);
+    for (i = 0; i < ENT_MAX; i++) {
+        entity_clear(entity_store(i));
     }
 
-    while (Game.stage->debrisHead.next) {
-        Deb = Game.stage->debrisHead.next;
-        Game.stage->debrisHead.next = Deb->next;
-        free(Deb);
-    }
+    Game.scenary.explosions.count = 0;
+    Game.scenary.debris.count = 0;
 
     memset(Game.stage, 0, sizeof(Stage));
 
-    Game.stage->playerTail = &Game.stage->playerHead;
-    Game.stage->playerBulletTail = &Game.stage->playerBulletHead;
-    Game.stage->enemyBulletTail = &Game.stage->enemyBulletHead;
-    Game.stage->enemyTail = &Game.stage->enemyHead;
-    Game.stage->explosionTail = &Game.stage->explosionHead;
-    Game.stage->debrisTail = &Game.stage->debrisHead;
-
     Game.stage->init_stage = init_stage;
     Game.stage->reset_stage = reset_stage;
     Game.stage->score = 0;
@@ -455,60 +838,129 @@ static void reset_stage(void) {
 
     enemySpawnTimer = 0;
     stageResetTimer = FPS*3;
+
+    // The old stage's explosions should not ring on into the new one
+    Game.sounds->stop_sounds();
+
+    rewind_mark_start();
 }
 
 static void init_player(void) {
 
-    Game.entities.player = malloc(sizeof(Entity));
-    Game.entities.player = memset(Game.entities.player, 0, sizeof(Entity));
+    Entity* player = entity_spawn(entity_store(ENT_PLAYER));
 
-    Game.stage->playerTail->next = Game.entities.player;
-    Game.stage->playerTail = Game.entities.player;
+    Game.entities.player = player->handle;
 
-    Game.entities.player->x = 100;
-    Game.entities.player->y = 100;
-    Game.entities.player->heath = 1;
-    Game.entities.player->texture = gPlayerTexture;
+    player->x = player->prevX = 100;
+    player->y = player->prevY = 100;
+    player->heath = 1;
+    player->sprite = SPR_PLAYER;
 
-    // Query texture w and h and set it on player
-    SDL_QueryTexture(
-        Game.entities.player->texture,
-        NULL,
-        NULL,
-        &Game.entities.player->w,
-        &Game.entities.player->h
-    );
+    // Take w and h from the sprite
+    player->w = Game.graphics->atlas.sprites[SPR_PLAYER].rect.w;
+    player->h = Game.graphics->atlas.sprites[SPR_PLAYER].rect.h;
 }
 
 static void init_starfield(void) {
 
     int i;
     for (i = 0; i < MAX_STARS; i++) {
-        Game.scenary.stars[i].x  = rand() % SCREEN_W;
-        Game.scenary.stars[i].y  = rand() % SCREEN_H;
-        Game.scenary.stars[i].speed = 1 + rand() % 8;
+        Game.scenary.stars[i].x  = rng_next() % SCREEN_W;
+        Game.scenary.stars[i].y  = rng_next() % SCREEN_H;
+        Game.scenary.stars[i].speed = 1 + rng_next() % STAR_SPEEDS;
+    }
+
+    for (i = 0; i < STAR_SPEEDS; i++) {
+        Game.scenary.starOffset[i] = 0;
+    }
+
+    // The renderer draws them into the star layers when it sees this
+    Game.scenary.starGeneration++;
+}
+
+// Redraws the star layers drawn from an older generation of stars
+static void render_star_layers(Star* stars, int generation) {
+    // Kept between redraws, a stage reset should not allocate
+    static SDL_Rect rects[MAX_STARS * 2];
+    Star* star;
+    int i, s, n, c;
+
+    for (s = 0; s < STAR_SPEEDS; s++) {
+        if (!cache_begin(CACHE_STARS + s, generation)) {
+            continue;
+        }
+
+        // Stars hanging off the right edge also go in on the left so the
+        // layer tiles without a seam
+        for (i = 0, n = 0; i < MAX_STARS; i++) {
+            star = &stars[i];
+            if (star->speed != s + 1) {
+                continue;
+            }
+
+            rects[n++] = (SDL_Rect) { star->x, star->y, 4, 1 };
+            if (star->x + 4 > SCREEN_W) {
+                rects[n++] = (SDL_Rect) { star->x - SCREEN_W, star->y, 4, 1 };
+            }
+        }
+
+        c = 32 * (s + 1);
+        render_color(c, c, c, 255);
+        render_fill_rects(rects, n);
+
+        cache_end();
     }
 }
 
+// The player and enemies move first, they spawn bullets. Scenery, particle
+// integration and bullet movement with their grid queries then run as jobs.
+// Hits are applied after the join in store order, so a run plays out the
+// same whatever the number of threads.
 static void logic(void) {
 
-        do_background();
+        SDL_atomic_t pending = { 0 };
+        BulletPass* playerBullets = &Game.entities.player_bullets;
+        BulletPass* enemyBullets = &Game.entities.enemy_bullets;
+        int explosions = Game.scenary.explosions.count;
+        int debris = Game.scenary.debris.count;
 
-        do_starfield();
+        PROFILE_ZONE(ZONE_DO_PLAYER, do_player());
 
-        do_player();
+        PROFILE_ZONE(ZONE_DO_ENEMIES, do_enemies());
 
-        do_enemies();
+        profile_begin(ZONE_SIM_JOBS);
 
-        do_bullets();
+        Game.jobs->submit(&pending, scenery_job, NULL, 0, 1);
 
-        do_enemy_bullets();
+        bullets_begin(playerBullets, entity_store(ENT_PLAYER_BULLET),
+            &Game.entities.enemy_grid, entity_store(ENT_ENEMY), SDL_TRUE);
+        bullets_begin(enemyBullets, entity_store(ENT_ENEMY_BULLET),
+            &Game.entities.player_grid, entity_store(ENT_PLAYER), get_player() != NULL);
 
-        do_explosions();
+        Game.jobs->parallel_for(&pending, bullets_job, playerBullets, playerBullets->count, JOB_GRAIN_BULLETS);
+        Game.jobs->parallel_for(&pending, bullets_job, enemyBullets, enemyBullets->count, JOB_GRAIN_BULLETS);
+        Game.jobs->parallel_for(&pending, particles_job, &Game.scenary.explosions, explosions, JOB_GRAIN_PARTICLES);
+        Game.jobs->parallel_for(&pending, particles_job, &Game.scenary.debris, debris, JOB_GRAIN_PARTICLES);
 
-        do_debris();
+        Game.jobs->wait(&pending);
 
-        spawn_enemy();
+        profile_end(ZONE_SIM_JOBS);
+
+        PROFILE_ZONE(ZONE_DO_BULLETS, bullets_resolve(playerBullets, bullet_hit_enemy, player_bullet_gone));
+
+        PROFILE_ZONE(ZONE_DO_ENEMY_BULLETS, bullets_resolve(enemyBullets, bullet_hit_player, enemy_bullet_gone));
+
+        // Particles added by this tick's hits still need their first step
+        PROFILE_ZONE(ZONE_DO_EXPLOSIONS, particles_update(&Game.scenary.explosions, explosions));
+
+        PROFILE_ZONE(ZONE_DO_DEBRIS, particles_update(&Game.scenary.debris, debris));
+
+        PROFILE_ZONE(ZONE_SPAWN_ENEMY, spawn_enemy());
+}
+
+static void scenery_job(void* data, int start, int end) {
+    do_background();
+    do_starfield();
 }
 
 static void init_sounds(void) {
@@ -519,408 +971,754 @@ static void init_sounds(void) {
 }
 
 static void load_sounds(void) {
-    Game.sounds->sounds[SND_PLAYER_FIRE] = Mix_LoadWAV("sfx/334227__jradcoolness__laser.ogg");
-    if (Game.sounds->sounds[SND_PLAYER_FIRE] == NULL) {
-        printf("Failed to load player fire sound! SDL Error %s\n", SDL_GetError());
-        exit(1);
-    }
-    Game.sounds->sounds[SND_ALIEN_FIRE] = Mix_LoadWAV("sfx/196914__dpoggioli__laser-gun.ogg");
-    if (Game.sounds->sounds[SND_ALIEN_FIRE] == NULL) {
-        printf("Failed to load alien fire sound! SDL Error %s\n", SDL_GetError());
-        exit(1);
-    }
-    Game.sounds->sounds[SND_PLAYER_DIE] = Mix_LoadWAV("sfx/245372__quaker540__hq-explosion.ogg");
-    if (Game.sounds->sounds[SND_PLAYER_DIE] == NULL) {
-        printf("Failed to load player die sound! SDL Error %s\n", SDL_GetError());
-        exit(1);
-    }
-    Game.sounds->sounds[SND_ALIEND_DIE] = Mix_LoadWAV("sfx/10 Guage Shotgun-SoundBible.com-74120584.ogg");
-    if (Game.sounds->sounds[SND_ALIEND_DIE] == NULL) {
-        printf("Failed to load alien die sound! SDL Error %s\n", SDL_GetError());
-        exit(1);
-    }
+    if (pack_load_sounds())
+        return;
+
+    load_sound_files();
 }
 
-static void play_sound(int id, int channel) {
-    Mix_PlayChannel(channel, Game.sounds->sounds[id], 0);
+static void load_sound_files(void) {
+    int i;
+
+    for (i = 0; i < SND_MAX; i++) {
+        if (!load_sound(i)) {
+            exit(1);
+        }
+    }
 }
 
-static void load_music(char* filename) {
-    if (Game.sounds->music != NULL) {
-        Mix_HaltMusic();
-        Mix_FreeMusic(Game.sounds->music);
-        Game.sounds->music = NULL;
+// Leaves exiting to the caller, it may be a worker
+static SDL_bool load_sound(int id) {
+    Game.sounds->sounds[id] = Mix_LoadWAV(soundFiles[id]);
+    if (Game.sounds->sounds[id] == NULL) {
+        printf("Failed to load sound %s! SDL Error %s\n", soundFiles[id], SDL_GetError());
+        return SDL_FALSE;
     }
 
-    Game.sounds->music = Mix_LoadMUS(filename);
+    return SDL_TRUE;
 }
-static void play_music(int loop) {
-    Mix_PlayMusic(Game.sounds->music, (loop) ? -1:0);
+
+// Only queues the sound, flush_sounds starts it at the end of the tick
+static void play_sound(int id, int channel) {
+    Sounds* sounds = Game.sounds;
+
+    sounds->stats.requested++;
+    if (sounds->pending[id]++ > 0) {
+        sounds->stats.merged++;
+    }
+    sounds->channels[id] = channel;
 }
 
-static void draw_text(int x, int y, int r, int g, int b, char *format, ...) {
-    int i, len, c;
-    SDL_Rect rect;
-    va_list args;
+// Starts one voice per sound requested this tick, in priority order until
+// the voice budget is spent. A voice is louder the more often it was asked
+// for.
+static void flush_sounds(void) {
+    Sounds* sounds = Game.sounds;
+    int voices = 0;
+    int id, best, volume, channel;
+
+    for (;;) {
+        best = -1;
+        for (id = 0; id < SND_MAX; id++) {
+            if (sounds->pending[id] > 0 && (best < 0 || soundPriority[id] > soundPriority[best])) {
+                best = id;
+            }
+        }
 
-    memset(&Game.text->drawTextBuffer, '\0', sizeof(Game.text->drawTextBuffer));
+        if (best < 0) {
+            break;
+        }
 
-    va_start(args, format);
-    vsprintf(Game.text->drawTextBuffer, format, args);
-    va_end(args);
+        volume = MIN(SND_VOLUME + (sounds->pending[best] - 1) * SND_MERGE_GAIN, SND_MERGE_MAX_VOLUME);
+        sounds->pending[best] = 0;
 
-    len = strlen(Game.text->drawTextBuffer);
-    rect.w = GLYPH_W;
-    rect.h = GLYPH_H;
-    rect.y = 0;
+        if (sounds->sounds[best] == NULL) {
+            continue;
+        }
 
-    SDL_SetTextureColorMod(gFontTexture, r, g, b);
+        if (voices == SND_VOICE_BUDGET) {
+            sounds->stats.dropped++;
+            continue;
+        }
 
-    for (i = 0; i<len; i++) {
-        c = Game.text->drawTextBuffer[i];
-        if (c >= ' ' && c <= 'Z') {
-            rect.x = (c - ' ') * GLYPH_W;
-            Game.graphics->blitRect(gFontTexture, &rect, x, y);
-            x += GLYPH_W;
+        if (Game.audio->enabled) {
+            audio_send(AUDIO_PLAY, sounds->channels[best], volume, sounds->sounds[best]);
+            sounds->stats.played++;
+            voices++;
+            continue;
         }
-    }
-}
 
-static void do_background(void) {
+        channel = Mix_PlayChannel(sounds->channels[best], sounds->sounds[best], 0);
+        if (channel < 0) {
+            sounds->stats.dropped++;
+            continue;
+        }
 
-    if (--backgroundX < -SCREEN_W) {
-        backgroundX = 0;
+        // SDL_mixer's channels stop at full volume, three repeats reach it
+        Mix_Volume(channel, MIN(volume, MIX_MAX_VOLUME));
+        sounds->stats.played++;
+        voices++;
     }
 }
 
-static void do_starfield(void) {
+// Stops every effect still playing
+static void stop_sounds(void) {
+    if (Game.headless) {
+        return;
+    }
 
-    int i;
+    if (Game.audio->enabled) {
+        audio_send(AUDIO_STOP, CH_ANY, 0, NULL);
+        return;
+    }
 
-     for (i = 0; i < MAX_STARS; i++) {
-         Game.scenary.stars[i].x -= Game.scenary.stars[i].speed;
-         if (Game.scenary.stars[i].x < 0) {
-             Game.scenary.stars[i].x = SCREEN_W + Game.scenary.stars[i].x;
-         }
-     }
+    Mix_HaltChannel(-1);
 }
 
-static void do_explosions(void) {
-
-    Explosion *e, *prev;
-    prev = &Game.stage->explosionHead;
-
-    for (e = Game.stage->explosionHead.next; e != NULL; e = e->next) {
-        e->x += e->dx;
-        e->y += e->dy;
-
-        if (--e->a <= 0) {
-
-            if (e == Game.stage->explosionTail) {
-                Game.stage->explosionTail = prev;
-            }
-
-            prev->next = e->next;
-            free(e);
-            e = prev;
-        }
+// Sets the volume of every effect still playing, the next one started
+// plays at its own volume again
+static void volume_sounds(int volume) {
+    if (Game.headless) {
+        return;
+    }
 
-        prev = e;
+    if (Game.audio->enabled) {
+        audio_send(AUDIO_VOLUME, CH_ANY, volume, NULL);
+        return;
     }
 
+    Mix_Volume(-1, volume);
 }
 
-static void do_debris(void) {
+static void print_sound_stats(void) {
+    SoundStats* stats = &Game.sounds->stats;
 
-  Debris *d, *prev;
-  prev = &Game.stage->debrisHead;
+    SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO,
+        "Sounds requested %ld played %ld merged %ld dropped %ld",
+        stats->requested, stats->played, stats->merged, stats->dropped);
+}
 
-  for (d = Game.stage->debrisHead.next; d != NULL; d = d->next) {
-    d->x += d->dx;
-    d->y += d->dy;
+// Sound effects bypass SDL_mixer's channels and are mixed on top of its
+// output. Only signed 16 bit devices are supported, anything else keeps
+// the SDL_mixer channels.
+static void audio_init(void) {
+    int frequency, channels;
+    Uint16 format;
 
-    // accelerate down
-    d->dy += 0.5;
+    if (Mix_QuerySpec(&frequency, &format, &channels) == 0 || format != AUDIO_S16SYS) {
+        printf("Audio device is not 16 bit, --mixer is off\n");
+        Game.audio->enabled = SDL_FALSE;
+        return;
+    }
 
-    if (--d->life <= 0) {
+    Mix_SetPostMix(audio_mix, Game.audio);
+}
 
-      if (d == Game.stage->debrisTail) {
-        Game.stage->debrisTail = prev;
-      }
+static void audio_quit(void) {
+    Audio* audio = Game.audio;
 
-      prev->next = d->next;
-      free(d);
-      d = prev;
+    if (!audio->enabled) {
+        return;
     }
 
-    prev = d;
-  }
+    // Returns once the callback is no longer running
+    Mix_SetPostMix(NULL, NULL);
+    audio->enabled = SDL_FALSE;
+
+    SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO,
+        "Audio commands sent %ld ring full %ld voices dropped %d",
+        audio->sent, audio->full, SDL_AtomicGet(&audio->dropped));
 }
 
-static void do_player(void) {
-    // Alias
-    if (Game.entities.player != NULL){
+// Game thread side of the ring. A full ring drops the command rather than
+// wait for the audio thread.
+static void audio_send(int type, int channel, int volume, Mix_Chunk* chunk) {
+    Audio* audio = Game.audio;
+    int head = SDL_AtomicGet(&audio->head);
+    AudioCommand* cmd;
 
-    Entity* player = Game.entities.player;
+    if ((Uint32)(head - SDL_AtomicGet(&audio->tail)) >= AUDIO_RING_SIZE) {
+        audio->full++;
+        return;
+    }
 
-        player->dx = player->dy = 0;
+    cmd = &audio->commands[(Uint32)head % AUDIO_RING_SIZE];
+    cmd->type = type;
+    cmd->channel = channel;
+    cmd->volume = volume;
+    cmd->samples = chunk != NULL ? (const Sint16*)chunk->abuf : NULL;
+    cmd->length = chunk != NULL ? chunk->alen / sizeof(Sint16) : 0;
 
-        if (player->reload > 0) {
-            player->reload--;
-        }
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&audio->head, head + 1);
+    audio->sent++;
+}
 
-        if (Game.input->keyboard[SDL_SCANCODE_K]) {
-            if (player->y > 0)
-                player->dy = -PLAYER_SPEED;
+// SDL_mixer's post mix callback, on the audio thread. Applies the queued
+// commands, then adds every playing voice to the stream.
+static void audio_mix(void* data, Uint8* stream, int len) {
+    Audio* audio = data;
+    int tail = SDL_AtomicGet(&audio->tail);
+    int head = SDL_AtomicGet(&audio->head);
+    AudioCommand* cmd;
+    AudioVoice* v;
+    int i, n;
+
+    SDL_MemoryBarrierAcquire();
+
+    for (; tail != head; tail++) {
+        cmd = &audio->commands[(Uint32)tail % AUDIO_RING_SIZE];
+
+        switch (cmd->type) {
+            case AUDIO_PLAY:
+                // Named channels cut what they were playing, CH_ANY takes
+                // a free voice or is dropped
+                i = cmd->channel;
+                if (i == CH_ANY) {
+                    for (i = CH_MAX; i < AUDIO_VOICES && audio->voices[i].samples != NULL; i++);
+                }
+                if (i >= AUDIO_VOICES) {
+                    SDL_AtomicAdd(&audio->dropped, 1);
+                    break;
+                }
+                audio->voices[i] = (AudioVoice) { cmd->samples, cmd->length, 0, cmd->volume };
+                break;
+            // Both act on one voice, or on all of them for CH_ANY
+            case AUDIO_STOP:
+                for (i = 0; i < AUDIO_VOICES; i++) {
+                    if (cmd->channel == CH_ANY || cmd->channel == i) {
+                        audio->voices[i].samples = NULL;
+                    }
+                }
+                break;
+            case AUDIO_VOLUME:
+                for (i = 0; i < AUDIO_VOICES; i++) {
+                    if (cmd->channel == CH_ANY || cmd->channel == i) {
+                        audio->voices[i].volume = cmd->volume;
+                    }
+                }
+                break;
+            default:
+                break;
         }
+    }
 
-        if (Game.input->keyboard[SDL_SCANCODE_J]) {
-            if (player->y < SCREEN_H - player->h)
-                player->dy = PLAYER_SPEED;
-        }
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&audio->tail, tail);
 
-        if (Game.input->keyboard[SDL_SCANCODE_H]) {
-            if (player->x > 0)
-                player->dx = -PLAYER_SPEED;
+    for (i = 0; i < AUDIO_VOICES; i++) {
+        v = &audio->voices[i];
+        if (v->samples == NULL) {
+            continue;
         }
 
-        if (Game.input->keyboard[SDL_SCANCODE_L]) {
-            if (player->x < SCREEN_W - player->w)
-                player->dx = PLAYER_SPEED;
-        }
+        n = MIN(v->length - v->position, (Uint32)len / sizeof(Sint16));
+        audio_mix_voice((Sint16*)stream, v->samples + v->position, n, v->volume);
 
-        if (Game.input->keyboard[SDL_SCANCODE_F] && player->reload == 0) {
-            Game.sounds->play_sound(SND_PLAYER_FIRE, CH_PLAYER);
-            fire_bullet();
+        v->position += n;
+        if (v->position >= v->length) {
+            v->samples = NULL;
         }
-
-        player->x += player->dx;
-        player->y += player->dy;
     }
-
 }
 
-static void do_enemies(void) {
+// dst += src * volume / MIX_MAX_VOLUME, saturating. The products are
+// widened to 32 bits, scaled, then packed back down with saturation.
+static void audio_mix_voice(Sint16* dst, const Sint16* src, int n, int volume) {
+    int i = 0, s;
 
-    Entity *e, *prev;
+#if defined(__AVX2__)
+    __m256i vol16 = _mm256_set1_epi16(volume);
 
-    prev = &Game.stage->enemyHead;
+    for (; i + 16 <= n; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i lo = _mm256_mullo_epi16(v, vol16);
+        __m256i hi = _mm256_mulhi_epi16(v, vol16);
+        __m256i a = _mm256_srai_epi32(_mm256_unpacklo_epi16(lo, hi), 7);
+        __m256i b = _mm256_srai_epi32(_mm256_unpackhi_epi16(lo, hi), 7);
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
 
-    for (e = Game.stage->enemyHead.next; e != NULL; e = e->next) {
-        e->x += e->dx;
-        e->y += e->dy;
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_adds_epi16(d, _mm256_packs_epi32(a, b)));
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i vol8 = _mm_set1_epi16(volume);
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i lo = _mm_mullo_epi16(v, vol8);
+        __m128i hi = _mm_mulhi_epi16(v, vol8);
+        __m128i a = _mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), 7);
+        __m128i b = _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), 7);
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_adds_epi16(d, _mm_packs_epi32(a, b)));
+    }
+#endif
 
-        if (e->x < -e->w || e->heath == 0) {
-            if (e == Game.stage->enemyTail) {
-                Game.stage->enemyTail = prev;
-            }
-            prev->next = e->next;
-            free(e);
-            e = prev;
-        } else if (Game.entities.player != NULL && --e->reload <= 0) {
-            fire_enemy_bullet(e);
-            Game.sounds->play_sound(SND_ALIEN_FIRE, CH_ALIEN_FIRE);
-        }
+    for (; i < n; i++) {
+        s = dst[i] + ((src[i] * volume) >> 7);
+        dst[i] = MIN(MAX(s, -32768), 32767);
+    }
+}
 
-        prev = e;
+// Music streams through SDL_mixer on both audio paths, --mixer only
+// replaces the effect channels. The ring is drained inside SDL_mixer's
+// audio lock, which Mix_FreeMusic takes too, so music stays off it.
+static void load_music(char* filename) {
+    if (Game.sounds->music != NULL) {
+        Mix_HaltMusic();
+        Mix_FreeMusic(Game.sounds->music);
+        Game.sounds->music = NULL;
     }
 
+    Game.sounds->music = Mix_LoadMUS(filename);
+}
+static void play_music(int loop) {
+    Mix_PlayMusic(Game.sounds->music, (loop) ? -1:0);
 }
 
-static void add_explosions(int x, int y, int num) {
-    Explosion *e;
-    int i;
-
-    for (i = 0; i < num; i++) {
-        e = malloc(sizeof(Explosion));
-        memset(e, 0, sizeof(Explosion));
-        Game.stage->explosionTail->next = e;
-        Game.stage->explosionTail = e;
+// Formats and draws a line of text. Lines are laid out into glyph quads
+// once and cached by content and color, so redrawing an unchanged line is
+// a single copy into the sprite batch.
+static void draw_text(int x, int y, int r, int g, int b, char *format, ...) {
+    SDL_Color color = { r, g, b, 255 };
+    TextRun* run;
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(Game.text->drawTextBuffer, sizeof(Game.text->drawTextBuffer), format, args);
+    va_end(args);
+
+    run = text_run(Game.text->drawTextBuffer, color);
+
+    batch_vertices(batch_bind_sprite(&Game.graphics->atlas.sprites[SPR_FONT]), run->vertices, run->quads, x, y);
+}
+
+// Index of c in the font, which starts at ' '. Lower case falls back to
+// upper case when the font has no lower case, and anything else the font
+// does not have is drawn as '?'.
+static int text_glyph(int c, int glyphs) {
+    if (c >= 'a' && c <= 'z' && c - ' ' >= glyphs) {
+        c -= 'a' - 'A';
+    }
+
+    if (c < ' ' || c - ' ' >= glyphs) {
+        c = '?';
+    }
+
+    return c - ' ';
+}
+
+static TextRun* text_run(const char* str, SDL_Color color) {
+    Sprite* font = &Game.graphics->atlas.sprites[SPR_FONT];
+    int pageW = Game.graphics->atlas.pageW[font->page];
+    int pageH = Game.graphics->atlas.pageH[font->page];
+    int glyphs = font->rect.w / GLYPH_W;
+    TextRun* run = NULL;
+    SDL_Rect rect;
+    Uint32 hash = 2166136261u;
+    const unsigned char* c;
+    int i, len, x, y;
+
+    for (c = (const unsigned char*)str; *c; c++) {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    len = c - (const unsigned char*)str;
+
+    Game.text->clock++;
+
+    for (i = 0; i < TEXT_CACHE_SIZE; i++) {
+        TextRun* t = &Game.text->runs[i];
+
+        if (t->hash == hash && t->color.r == color.r && t->color.g == color.g && t->color.b == color.b
+                && strcmp(t->text, str) == 0) {
+            t->lastUsed = Game.text->clock;
+            Game.text->hits++;
+            return t;
+        }
+
+        if (run == NULL || t->lastUsed < run->lastUsed) {
+            run = &Game.text->runs[i];
+        }
+    }
+
+    // Evict the least recently drawn line
+    if (run->capacity < len) {
+        run->capacity = MAX(len, TEXT_RUN_MIN);
+        run->vertices = MEM_REALLOC(MEM_TEXT, run->vertices, run->capacity * 4 * sizeof(SDL_Vertex));
+        if (run->vertices == NULL) {
+            printf("Failed to allocate text run!\n");
+            exit(1);
+        }
+    }
+
+    memcpy(run->text, str, len + 1);
+    run->hash = hash;
+    run->color = color;
+    run->lastUsed = Game.text->clock;
+    run->quads = 0;
+
+    rect.w = GLYPH_W;
+    rect.h = GLYPH_H;
+    rect.y = font->rect.y;
+
+    for (i = 0, x = 0, y = 0; i < len; i++) {
+        if (str[i] == '\n') {
+            x = 0;
+            y += GLYPH_H;
+            continue;
+        }
+
+        // Space is blank, no need for a quad
+        if (str[i] != ' ') {
+            rect.x = font->rect.x + text_glyph((unsigned char)str[i], glyphs) * GLYPH_W;
+            make_quad(&run->vertices[run->quads * 4], &rect, x, y, GLYPH_W, GLYPH_H, color, pageW, pageH);
+            run->quads++;
+        }
+
+        x += GLYPH_W;
+    }
+
+    Game.text->builds++;
+    return run;
+}
+
+static void text_init(void) {
+    TextRun* run;
+    int i;
+
+    for (i = 0; i < TEXT_CACHE_SIZE; i++) {
+        run = &Game.text->runs[i];
+        run->capacity = TEXT_RUN_MIN;
+        run->vertices = MEM_ALLOC(MEM_TEXT, run->capacity * 4 * sizeof(SDL_Vertex));
+        if (run->vertices == NULL) {
+            printf("Failed to allocate text run!\n");
+            exit(1);
+        }
+    }
+}
+
+static void text_destroy(void) {
+    int i;
+
+    for (i = 0; i < TEXT_CACHE_SIZE; i++) {
+        MEM_FREE(Game.text->runs[i].vertices);
+        memset(&Game.text->runs[i], 0, sizeof(TextRun));
+    }
+}
+
+static void print_text_stats(void) {
+    Text* text = Game.text;
+    long lines = text->hits + text->builds;
+
+    if (lines == 0) {
+        return;
+    }
+
+    SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO,
+        "Text lines drawn %ld, cache hits %ld (%.1f%%) built %ld",
+        lines, text->hits, text->hits * 100.0 / lines, text->builds);
+}
+
+static void do_background(void) {
+
+    if (--backgroundX < -SCREEN_W) {
+        backgroundX = 0;
+    }
+}
+
+static void do_starfield(void) {
+
+    int i;
+
+    for (i = 0; i < STAR_SPEEDS; i++) {
+        Game.scenary.starOffset[i] -= i + 1;
+        if (Game.scenary.starOffset[i] <= -SCREEN_W) {
+            Game.scenary.starOffset[i] += SCREEN_W;
+        }
+    }
+}
+
+static void do_player(void) {
+    // Alias
+    Entity* player = get_player();
+
+    if (player != NULL){
+
+        player->dx = player->dy = 0;
+
+        if (player->reload > 0) {
+            player->reload--;
+        }
+
+        if (Game.input->keyboard[SDL_SCANCODE_K]) {
+            if (player->y > 0)
+                player->dy = -PLAYER_SPEED;
+        }
+
+        if (Game.input->keyboard[SDL_SCANCODE_J]) {
+            if (player->y < SCREEN_H - player->h)
+                player->dy = PLAYER_SPEED;
+        }
+
+        if (Game.input->keyboard[SDL_SCANCODE_H]) {
+            if (player->x > 0)
+                player->dx = -PLAYER_SPEED;
+        }
+
+        if (Game.input->keyboard[SDL_SCANCODE_L]) {
+            if (player->x < SCREEN_W - player->w)
+                player->dx = PLAYER_SPEED;
+        }
+
+        if (Game.input->keyboard[SDL_SCANCODE_F] && player->reload == 0) {
+            Game.sounds->play_sound(SND_PLAYER_FIRE, CH_PLAYER);
+            fire_bullet();
+        }
+
+        player->prevX = player->x;
+        player->prevY = player->y;
+        player->x += player->dx;
+        player->y += player->dy;
+    }
+
+}
+
+static void do_enemies(void) {
+
+    EntityStore* enemies = entity_store(ENT_ENEMY);
+    SDL_bool player = get_player() != NULL;
+    Entity* e;
+    int i = 0;
+
+    // A kill moves the last enemy into slot i, which then still needs its turn
+    while (i < enemies->count) {
+        e = &enemies->entities[i];
+        e->prevX = e->x;
+        e->prevY = e->y;
+        e->x += e->dx;
+        e->y += e->dy;
+
+        if (e->x < -e->w || e->heath == 0) {
+            entity_kill(enemies, e);
+            continue;
+        }
+
+        if (player && --e->reload <= 0) {
+            fire_enemy_bullet(e);
+            Game.sounds->play_sound(SND_ALIEN_FIRE, CH_ALIEN_FIRE);
+        }
+
+        i++;
+    }
+
+}
+
+static void add_explosions(int x, int y, int num) {
+    Particles *p = &Game.scenary.explosions;
+    SDL_Color* c;
+    int i, first;
+
+    first = particles_emit(p, num);
 
-        e->x = x + (rand() % 32) - (rand() % 32);
-        e->y = y + (rand() % 32) - (rand() % 32);
-        e->dx = (rand() % 10) - (rand() % 10);
-        e->dy = (rand() % 10) - (rand() % 10);
+    for (i = first; i < first + num; i++) {
+        p->x[i] = x + (rng_next() % 32) - (rng_next() % 32);
+        p->y[i] = y + (rng_next() % 32) - (rng_next() % 32);
+        p->dx[i] = (rng_next() % 10) - (rng_next() % 10);
+        p->dy[i] = (rng_next() % 10) - (rng_next() % 10);
 
-        e->dx /= 10;
-        e->dy /= 10;
+        p->dx[i] /= 10;
+        p->dy[i] /= 10;
+        p->px[i] = p->x[i];
+        p->py[i] = p->y[i];
 
-        switch (rand() % 4) {
+        c = &p->color[i];
+        c->r = c->g = c->b = 0;
+
+        switch (rng_next() % 4) {
             case 0:
-                e->r = 255;
+                c->r = 255;
                 break;
 
             case 1:
-                e->r = 255;
-                e->g = 128;
+                c->r = 255;
+                c->g = 128;
                 break;
 
             case 2:
-                e->r = 255;
-                e->g = 255;
+                c->r = 255;
+                c->g = 255;
                 break;
 
             default:
-                e->r = 255;
-                e->g = 255;
-                e->b = 255;
+                c->r = 255;
+                c->g = 255;
+                c->b = 255;
                 break;
 
         }
 
-        e->a = rand() % FPS * 3;
+        p->life[i] = rng_next() % FPS * 3;
     }
 }
 static void add_debris(Entity *e) {
-    Debris *d;
-    int x, y, w, h;
+    Particles *p = &Game.scenary.debris;
+    int x, y, w, h, i;
 
     w = e->w /3;
     h = e->h /4;
 
-    for(y = 0; y <= h; y += h) {
-        for(x = 0; x <= w; x += w) {
-            d = malloc(sizeof(Debris));
-            memset(d, 0, sizeof(Debris));
-            Game.stage->debrisTail->next = d;
-            Game.stage->debrisTail = d;
-
-            d->x = e->x + e->w / 2;
-            d->y = e->y + e->h / 2;
-            d->dx = (rand() % 5) - (rand() % 5);
-            d->dy = -(5 + (rand() % 12));
-            d->life = FPS * 2;
-            d->texture = e->texture;
+    // 2x2 chunks from the top left of the sprite
+    i = particles_emit(p, 4);
 
-            d->rect.x = x;
-            d->rect.y = y;
-            d->rect.w = w;
-            d->rect.h = h;
+    for(y = 0; y <= h; y += h) {
+        for(x = 0; x <= w; x += w, i++) {
+            p->x[i] = p->px[i] = e->x + e->w / 2;
+            p->y[i] = p->py[i] = e->y + e->h / 2;
+            p->dx[i] = (rng_next() % 5) - (rng_next() % 5);
+            p->dy[i] = -(5 + (rng_next() % 12));
+            p->life[i] = FPS * 2;
+            p->sprite[i] = e->sprite;
+
+            p->rect[i].x = x;
+            p->rect[i].y = y;
+            p->rect[i].w = w;
+            p->rect[i].h = h;
         }
     }
 }
 
 static void spawn_enemy(void) {
 
-    Game.entities.enemy = malloc(sizeof(Entity));
-    memset(Game.entities.enemy, 0, sizeof(Entity));
-
-    Entity* enemy = Game.entities.enemy;
     if (--enemySpawnTimer <= 0) {
-        Game.stage->enemyTail->next = enemy;
-        Game.stage->enemyTail = enemy;
+        Entity* enemy = entity_spawn(entity_store(ENT_ENEMY));
         enemy->heath = 1;
 
-        enemy->texture = gEnemyTexture;
-        SDL_QueryTexture(enemy->texture, NULL, NULL, &enemy->w, &enemy->h);
+        enemy->sprite = SPR_ENEMY;
+        enemy->w = Game.graphics->atlas.sprites[SPR_ENEMY].rect.w;
+        enemy->h = Game.graphics->atlas.sprites[SPR_ENEMY].rect.h;
         enemy->x = SCREEN_W;
-        enemy->y = rand() % (SCREEN_H - enemy->h);
+        enemy->y = rng_next() % (SCREEN_H - enemy->h);
+        enemy->prevX = enemy->x;
+        enemy->prevY = enemy->y;
 
-        enemy->dx = -(2 +(rand() % 4));
-        enemySpawnTimer = 30 + (rand()%60);
+        enemy->dx = -(2 +(rng_next() % 4));
+        enemySpawnTimer = 30 + (rng_next()%60);
 
     }
 }
 
 static void draw_enemy(void) {
-    Entity *e;
+    draw_layer(LAYER_ENEMIES);
+}
 
-    for (e = Game.stage->enemyHead.next; e != NULL; e = e->next) {
-        Game.graphics->blit(e->texture, e->x, e->y);
-    }
+static int player_bullet_gone(Entity* b) {
+    return b->x > SCREEN_W;
 }
 
-static void do_bullets(void) {
-    Entity *b, *prev;
+static int enemy_bullet_gone(Entity* b) {
+    return b->x < -b->w || b->y < -b->h || b->x > SCREEN_W || b->y > SCREEN_H;
+}
 
-    prev = &Game.stage->playerBulletHead;
+// Builds the grid of targets and makes room for a hit per bullet. The
+// hits grow with the store, not with each new high in bullets.
+static void bullets_begin(BulletPass* pass, EntityStore* bullets, Grid* grid, EntityStore* targets, SDL_bool collide) {
+    int n = bullets->count;
 
-    for (b = Game.stage->playerBulletHead.next; b != NULL; b = b->next) {
-        b->x += b->dx;
-        b->y += b->dy;
+    grid_build(grid, targets);
 
-        if (bullet_hit_enemy(b) || b->x > SCREEN_W) {
-            if (b == Game.stage->playerBulletTail) {
-                Game.stage->playerBulletTail = prev;
-            }
-            prev->next = b->next;
-            free(b);
-            b = prev;
-        }
+    if (n > pass->capacity) {
+        pass->capacity = MAX(n, bullets->capacity);
+        pass->hits = MEM_REALLOC(MEM_BULLETS, pass->hits, pass->capacity * sizeof(int));
 
-        prev = b;
+        if (!pass->hits) {
+            printf("Failed to grow bullet pass to %d bullets!\n", pass->capacity);
+            sim_fail();
+        }
     }
-}
 
-static void do_enemy_bullets(void) {
-    Entity *b, *prev;
+    pass->bullets = bullets;
+    pass->targets = targets;
+    pass->count = n;
+    pass->grid = grid;
+    pass->collide = collide;
+    SDL_AtomicSet(&pass->tests, 0);
+}
 
-    prev = &Game.stage->enemyBulletHead;
-    int bul = 0;
+// Moves bullets start..end and finds what each one hits, touching nothing
+// outside its own slice
+static void bullets_job(void* data, int start, int end) {
+    BulletPass* pass = data;
+    Entity* b;
+    long tests = 0;
+    int i;
 
-    for (b = Game.stage->enemyBulletHead.next; b != NULL; b = b->next) {
+    for (i = start; i < end; i++) {
+        b = &pass->bullets->entities[i];
+        b->prevX = b->x;
+        b->prevY = b->y;
         b->x += b->dx;
         b->y += b->dy;
-        bul++;
-
-        if (bullet_hit_player(b) || b->x < -b->w || b->y < -b->h || b->x > SCREEN_W || b->y > SCREEN_H) {
-            if (b == Game.stage->enemyBulletTail) {
-                Game.stage->enemyBulletTail = prev;
-            }
-            prev->next = b->next;
-            free(b);
-            bul--;
-            b = prev;
-        }
 
-        /* printf("bullets on screen: %d\r", bul); */
-        prev = b;
+        pass->hits[i] = pass->collide ? grid_first_hit(pass->grid, b, &tests) : -1;
     }
-}
 
-static int bullet_hit_enemy(Entity* b) {
-
-    Entity* e;
+    SDL_AtomicAdd(&pass->tests, (int)tests);
+}
 
-    for(e = Game.stage->enemyHead.next; e != NULL; e = e->next) {
-        if (detect_colision(b, e)) {
-            b->heath = 0;
-            e->heath = 0;
+// Applies the hits in bullet order, then removes the bullets that hit
+// something or left the screen. Targets are only marked, the owner of
+// their store removes them.
+static void bullets_resolve(BulletPass* pass, void (*hit)(Entity*, Entity*), int (*gone)(Entity*)) {
+    EntityStore* bullets = pass->bullets;
+    Entity* b;
+    int i;
 
-            Game.sounds->play_sound(SND_ALIEND_DIE, CH_ANY);
-            Game.stage->score++;
-            highscore = MAX(Game.stage->score, highscore);
-            add_explosions(e->x, e->y, 32);
-            add_debris(e);
+    grid_count(pass->grid, SDL_AtomicGet(&pass->tests), pass->collide ? pass->count : 0);
 
-            return 1;
+    for (i = 0; i < pass->count; i++) {
+        if (pass->hits[i] != -1) {
+            hit(&bullets->entities[i], &pass->targets->entities[pass->hits[i]]);
         }
     }
 
-    return 0;
+    i = 0;
+    while (i < bullets->count) {
+        b = &bullets->entities[i];
+        if (b->heath <= 0 || gone(b)) {
+            entity_kill(bullets, b);
+            continue;
+        }
+        i++;
+    }
 }
 
-static int bullet_hit_player(Entity* b) {
+static void bullets_destroy(BulletPass* pass) {
+    MEM_FREE(pass->hits);
 
-    if (Game.entities.player == NULL) {
-        return 0;
-    }
+    pass->hits = NULL;
+    pass->count = pass->capacity = 0;
+}
 
-    Entity* e;
+static void bullet_hit_enemy(Entity* b, Entity* e) {
+    b->heath = 0;
+    e->heath = 0;
 
-    for(e = Game.stage->playerHead.next; e != NULL; e = e->next) {
-        if (detect_colision(b, e)) {
-            b->heath = 0;
-            e->heath = 0;
+    Game.sounds->play_sound(SND_ALIEND_DIE, CH_ANY);
+    Game.stage->score++;
+    highscore = MAX(Game.stage->score, highscore);
+    add_explosions(e->x, e->y, 32);
+    add_debris(e);
+}
 
-            add_explosions(e->x, e->y, 32);
-            add_debris(e);
-            Game.sounds->play_sound(SND_PLAYER_DIE, CH_PLAYER);
-            return 1;
-        }
-    }
+static void bullet_hit_player(Entity* b, Entity* e) {
+    b->heath = 0;
+    e->heath = 0;
 
-    return 0;
+    add_explosions(e->x, e->y, 32);
+    add_debris(e);
+    Game.sounds->play_sound(SND_PLAYER_DIE, CH_PLAYER);
 }
 
 
@@ -931,14 +1729,8 @@ static int detect_colision(Entity* ent1, Entity* ent2) {
 
 static void fire_bullet(void) {
 
-    Game.entities.player_bullet = malloc(sizeof(Entity));
-    memset(Game.entities.player_bullet, 0, sizeof(Entity));
-
-    Entity* bullet = Game.entities.player_bullet;
-    Entity* player = Game.entities.player;
-
-    Game.stage->playerBulletTail->next = bullet;
-    Game.stage->playerBulletTail = bullet;
+    Entity* bullet = entity_spawn(entity_store(ENT_PLAYER_BULLET));
+    Entity* player = get_player();
 
     // set initial position of the bullet
     bullet->x = player->x;
@@ -946,10 +1738,13 @@ static void fire_bullet(void) {
 
     bullet->dx = PLAYER_BULLET_SPEED;
     bullet->heath = 1;
-    bullet->texture = gPlayerBulletTexture;
-    SDL_QueryTexture(bullet->texture, NULL, NULL, &bullet->w, &bullet->h);
+    bullet->sprite = SPR_PLAYER_BULLET;
+    bullet->w = Game.graphics->atlas.sprites[SPR_PLAYER_BULLET].rect.w;
+    bullet->h = Game.graphics->atlas.sprites[SPR_PLAYER_BULLET].rect.h;
 
     bullet->y += (player->h / 2) - (bullet->h / 2);
+    bullet->prevX = bullet->x;
+    bullet->prevY = bullet->y;
 
     player->reload = 8;
 
@@ -957,25 +1752,21 @@ static void fire_bullet(void) {
 
 static void fire_enemy_bullet(Entity* e) {
 
-    Game.entities.enemy_bullet = malloc(sizeof(Entity));
-    memset(Game.entities.enemy_bullet, 0, sizeof(Entity));
-
-    Entity* bullet = Game.entities.enemy_bullet;
-    /* Entity* player = Game.entities.player; */
-
-    Game.stage->enemyBulletTail->next = bullet;
-    Game.stage->enemyBulletTail = bullet;
+    Entity* bullet = entity_spawn(entity_store(ENT_ENEMY_BULLET));
 
     bullet->x = e->x;
     bullet->y = e->y;
     bullet->heath = 1;
-    bullet->texture = gEnemyBulletTexture;
-    SDL_QueryTexture(bullet->texture, NULL, NULL, &bullet->w, &bullet->h);
+    bullet->sprite = SPR_ENEMY_BULLET;
+    bullet->w = Game.graphics->atlas.sprites[SPR_ENEMY_BULLET].rect.w;
+    bullet->h = Game.graphics->atlas.sprites[SPR_ENEMY_BULLET].rect.h;
 
     bullet->x += (e->w / 2) - (bullet->w / 2);
     bullet->y += (e->h / 2) - (bullet->h / 2);
+    bullet->prevX = bullet->x;
+    bullet->prevY = bullet->y;
 
-    Entity* player = Game.entities.player;
+    Entity* player = get_player();
     Game.entities.calc_slope(
         player->x + (player->w / 2),
         player->y + (player->h / 2),
@@ -988,244 +1779,3105 @@ static void fire_enemy_bullet(Entity* e) {
     bullet->dx *= ENEMY_BULLET_SPPED;
     bullet->dy *= ENEMY_BULLET_SPPED;
 
-    e->reload = (rand() % FPS * 2);
+    e->reload = (rng_next() % FPS * 2);
 }
 
 // present_scene will clear the screen and set the background color
 void prepare_scene(void) {
-    SDL_SetRenderDrawColor(Game.screen->renderer, 0x12, 0x12, 0x12, 0xFF);
-    SDL_RenderClear(Game.screen->renderer);
+    render_color(0x12, 0x12, 0x12, 0xFF);
+    render_clear();
 }
 
 void present_scene(void) {
-    SDL_RenderPresent(Game.screen->renderer);
+    Game.graphics->flush();
+    render_present();
 }
 
-static SDL_Texture* load_texture(const char* filename) {
-    SDL_Texture* texture;
+// Returns NULL when the image can't be used, exiting is left to the caller
+// as it may be a worker
+static SDL_Surface* load_surface(const char* filename) {
+    SDL_Surface* loaded;
+    SDL_Surface* surface;
     SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO, "Loading %s", filename);
 
-    texture = IMG_LoadTexture(Game.screen->renderer, filename);
-    if (texture == NULL) {
-        printf("Failed to load texture %s! SDL Error: %s\n", filename, SDL_GetError());
-        exit(1);
+    loaded = IMG_Load(filename);
+    if (loaded == NULL) {
+        printf("Failed to load image %s! SDL Error: %s\n", filename, SDL_GetError());
+        return NULL;
     }
 
-    return texture;
+    surface = SDL_ConvertSurfaceFormat(loaded, SDL_PIXELFORMAT_RGBA32, 0);
+    SDL_FreeSurface(loaded);
+    if (surface == NULL) {
+        printf("Failed to convert image %s! SDL Error: %s\n", filename, SDL_GetError());
+        return NULL;
+    }
+
+    return surface;
 }
 
-// The blit function simply draws the specified texture on screen
-// at specified x and y coordinates
-static void blit(SDL_Texture *texture, int x, int y) {
-    SDL_Rect dest;
+static void load_atlas(void) {
+    if (pack_load_atlas())
+        return;
 
-    dest.x = x;
-    dest.y = y;
-    SDL_QueryTexture(texture, NULL, NULL, &dest.w, &dest.h);
+    atlas_pack(atlas_page_size());
 
-    SDL_RenderCopy(Game.screen->renderer, texture, NULL, &dest);
+    // Headless runs only need the sprite sizes
+    if (Game.headless) {
+        atlas_destroy();
+        return;
+    }
+
+    atlas_upload();
 }
-static void blitRect(SDL_Texture* texture, SDL_Rect* src, int x, int y) {
 
-    SDL_Rect dest;
+static int atlas_page_size(void) {
+    SDL_RendererInfo info;
+    int pageSize = ATLAS_PAGE_SIZE;
 
-    dest.x = x;
-    dest.y = y;
-    dest.w = src->w;
-    dest.h = src->h;
+    if (SDL_GetRendererInfo(Game.screen->renderer, &info) == 0 && info.max_texture_width > 0) {
+        pageSize = MIN(pageSize, MIN(info.max_texture_width, info.max_texture_height));
+    }
 
-    SDL_RenderCopy(Game.screen->renderer, texture, src, &dest);
+    return pageSize;
 }
 
+static void atlas_pack(int pageSize) {
+    SDL_Surface* images[SPR_MAX];
+    int i;
 
-static void do_key_up(SDL_KeyboardEvent* event) {
-    // check if the keyboard event was a result of  Keyboard repeat event
-    if (event->repeat == 0 && event->keysym.scancode < MAX_KEYBOARD_KEYS) {
-        Game.input->keyboard[event->keysym.scancode] = 0;
+    for (i = 0; i < SPR_MAX; i++) {
+        images[i] = load_surface(spriteFiles[i]);
+        if (images[i] == NULL) {
+            exit(1);
+        }
     }
-}
 
-static void do_key_down(SDL_KeyboardEvent* event) {
-    // check if the keyboard event was a result of  Keyboard repeat event
-    if (event->repeat == 0 && event->keysym.scancode < MAX_KEYBOARD_KEYS) {
-        Game.input->keyboard[event->keysym.scancode] = 1;
+    if (!atlas_pack_images(images, pageSize)) {
+        exit(1);
     }
 }
 
-static void draw(void) {
-    draw_background();
-    draw_startfield();
-    draw_player();
-    draw_bullets();
-    draw_enemy_bullets();
-    draw_enemy();
-    draw_debris();
-    draw_explosions();
-    draw_hud();
-}
+// Shelf packs every sprite, tallest first, into pages no bigger than
+// pageSize and copies the pixels into one surface per page. Frees the
+// images. Returns SDL_FALSE when they can't be packed, exiting is left
+// to the caller as it may be a worker.
+static SDL_bool atlas_pack_images(SDL_Surface** images, int pageSize) {
+    Atlas* atlas = &Game.graphics->atlas;
+    int order[SPR_MAX];
+    int i, j, id, tmp;
+    int shelfX = 0, shelfY = 0, shelfH = 0;
+    Sprite* s;
+
+    for (i = 0; i < SPR_MAX; i++) {
+        order[i] = i;
+
+        if (images[i]->w > pageSize || images[i]->h > pageSize) {
+            printf("Sprite %s does not fit a %d atlas page!\n", spriteFiles[i], pageSize);
+            return SDL_FALSE;
+        }
+    }
 
-static void draw_hud(void) {
-    Game.text->draw_text(10, 10, 255, 255, 255, "SCORE: %03d", Game.stage->score);
+    for (i = 1; i < SPR_MAX; i++) {
+        for (j = i; j > 0 && images[order[j]]->h > images[order[j - 1]]->h; j--) {
+            tmp = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = tmp;
+        }
+    }
 
-    Game.text->draw_text(SCREEN_W - (5*GLYPH_W) - 10, 10, 255,0,0, "%.2f", Game.elapsed);
+    atlas->pageCount = 1;
+    atlas->pageW[0] = atlas->pageH[0] = 0;
 
-    if (Game.stage->score > 0 && Game.stage->score == highscore) {
-        Game.text->draw_text(10, (SCREEN_H - 10 - GLYPH_H), 0, 255, 0, "HIGH SCORE: %03d", highscore);
-    } else {
-        Game.text->draw_text(10, (SCREEN_H - 10- GLYPH_H), 255, 255, 255, "HIGH SCORE: %03d", highscore);
-    }
+    for (i = 0; i < SPR_MAX; i++) {
+        id = order[i];
+        s = &atlas->sprites[id];
 
+        if (shelfX + images[id]->w > pageSize) {
+            shelfY += shelfH + ATLAS_PADDING;
+            shelfX = shelfH = 0;
+        }
 
-}
+        if (shelfY + images[id]->h > pageSize) {
+            if (atlas->pageCount == ATLAS_MAX_PAGES) {
+                printf("Sprites do not fit in %d atlas pages!\n", ATLAS_MAX_PAGES);
+                return SDL_FALSE;
+            }
 
-static void draw_background(void) {
+            atlas->pageW[atlas->pageCount] = atlas->pageH[atlas->pageCount] = 0;
+            atlas->pageCount++;
+            shelfX = shelfY = shelfH = 0;
+        }
 
-    SDL_Rect dest;
-    int x;
+        s->filename = spriteFiles[id];
+        s->page = atlas->pageCount - 1;
+        s->rect.x = shelfX;
+        s->rect.y = shelfY;
+        s->rect.w = images[id]->w;
+        s->rect.h = images[id]->h;
+        s->blend = sprite_blend(id);
 
-    for (x = backgroundX; x < SCREEN_W; x += SCREEN_W) {
-        dest.x = x;
-        dest.y = 0;
-        dest.w = SCREEN_W;
-        dest.h = SCREEN_H;
+        atlas->pageW[s->page] = MAX(atlas->pageW[s->page], shelfX + s->rect.w);
+        atlas->pageH[s->page] = MAX(atlas->pageH[s->page], shelfY + s->rect.h);
 
-        SDL_RenderCopy(Game.screen->renderer, gBackGroundTexture, NULL, &dest);
+        shelfX += s->rect.w + ATLAS_PADDING;
+        shelfH = MAX(shelfH, s->rect.h);
     }
-}
 
-static void draw_startfield(void) {
-    int i, c;
+    for (i = 0; i < atlas->pageCount; i++) {
+        atlas->surfaces[i] = SDL_CreateRGBSurfaceWithFormat(0, atlas->pageW[i], atlas->pageH[i], 32, SDL_PIXELFORMAT_RGBA32);
+        if (atlas->surfaces[i] == NULL) {
+            printf("Failed to create atlas page! SDL Error: %s\n", SDL_GetError());
+            return SDL_FALSE;
+        }
+        SDL_FillRect(atlas->surfaces[i], NULL, 0);
+    }
 
-    for (i = 0; i < MAX_STARS; i++) {
-        c = 32 * Game.scenary.stars[i].speed;
-        SDL_SetRenderDrawColor(Game.screen->renderer, c, c, c, c);
-        SDL_RenderDrawLine(Game.screen->renderer,
-                Game.scenary.stars[i].x,
-                Game.scenary.stars[i].y,
-                Game.scenary.stars[i].x+3,
-                Game.scenary.stars[i].y);
+    for (i = 0; i < SPR_MAX; i++) {
+        s = &atlas->sprites[i];
+        SDL_SetSurfaceBlendMode(images[i], SDL_BLENDMODE_NONE);
+        SDL_BlitSurface(images[i], NULL, atlas->surfaces[s->page], &s->rect);
+        SDL_FreeSurface(images[i]);
+        images[i] = NULL;
     }
-}
 
-static void draw_debris(void) {
-    Debris *d;
+    SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO,
+        "Packed %d sprites into %d atlas page(s)", SPR_MAX, atlas->pageCount);
 
-    for (d = Game.stage->debrisHead.next; d != NULL; d = d->next) {
-        blitRect(d->texture, &d->rect, d->x, d->y);
-    }
+    return SDL_TRUE;
 }
 
-static void draw_explosions(void) {
-    Explosion *e;
+static void atlas_upload(void) {
+    Atlas* atlas = &Game.graphics->atlas;
+    int i;
 
-    SDL_SetRenderDrawBlendMode(Game.screen->renderer, SDL_BLENDMODE_ADD);
-    SDL_SetTextureBlendMode(gExplosionTexture, SDL_BLENDMODE_ADD);
+    for (i = 0; i < atlas->pageCount; i++) {
+        atlas->pages[i] = SDL_CreateTextureFromSurface(Game.screen->renderer, atlas->surfaces[i]);
+        if (atlas->pages[i] == NULL) {
+            printf("Failed to upload atlas page %d! SDL Error: %s\n", i, SDL_GetError());
+            exit(1);
+        }
 
-    for (e = Game.stage->explosionHead.next; e != NULL; e = e->next) {
-      SDL_SetTextureColorMod(gExplosionTexture, e->r, e->g, e->b);
-      SDL_SetTextureAlphaMod(gExplosionTexture, e->a);
-      blit(gExplosionTexture, e->x, e->y);
+        SDL_FreeSurface(atlas->surfaces[i]);
+        atlas->surfaces[i] = NULL;
     }
+}
+
+static void atlas_destroy(void) {
+    Atlas* atlas = &Game.graphics->atlas;
+    int i;
 
-    SDL_SetRenderDrawBlendMode(Game.screen->renderer, SDL_BLENDMODE_NONE);
+    for (i = 0; i < atlas->pageCount; i++) {
+        SDL_FreeSurface(atlas->surfaces[i]);
+        SDL_DestroyTexture(atlas->pages[i]);
+        atlas->surfaces[i] = NULL;
+        atlas->pages[i] = NULL;
+    }
 
+    atlas->pageCount = 0;
 }
 
-static void draw_player(void) {
-    if (Game.entities.player != NULL){
-        Entity* player = Game.entities.player;
-        Game.graphics->blit(player->texture, player->x, player->y);
-    }
+static SDL_BlendMode sprite_blend(int id) {
+    return (id == SPR_EXPLOSION) ? SDL_BLENDMODE_ADD : SDL_BLENDMODE_BLEND;
 }
 
-static void draw_bullets(void) {
-    Entity *b;
+// Maps ASSET_PACK once and checks its tables against what this build
+// expects. Without a usable pack everything loads from the loose files.
+static SDL_bool pack_open(void) {
+    Pack* pack = Game.pack;
+    const PackHeader* header;
+    const PackSprite* sprite;
+    size_t tables;
+    Uint32 i;
 
-    for (b = Game.stage->playerBulletHead.next; b != NULL; b = b->next) {
-        Game.graphics->blit(b->texture, b->x, b->y);
-    }
-}
+    if (pack->opened)
+        return pack->data != NULL;
 
-static void draw_enemy_bullets(void) {
-    Entity *b;
+    pack->opened = SDL_TRUE;
 
-    for (b = Game.stage->enemyBulletHead.next; b != NULL; b = b->next) {
-        Game.graphics->blit(b->texture, b->x, b->y);
-    }
-}
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(ASSET_PACK, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER size;
 
-static void calc_slope(int srcX, int srcY, int dstX, int dstY, float *refX, float * refY) {
-    int steps = MAX(abs(srcX-dstX), abs(srcY-dstY));
-    if (steps == 0) {
-        *refX = *refY = 0;
-        return;
+    if (file == INVALID_HANDLE_VALUE)
+        return SDL_FALSE;
+
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0) {
+        pack->handle = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (pack->handle != NULL) {
+            pack->data = MapViewOfFile(pack->handle, FILE_MAP_READ, 0, 0, 0);
+            pack->size = (size_t)size.QuadPart;
+        }
+    }
+    CloseHandle(file);
+#else
+    int fd = open(ASSET_PACK, O_RDONLY);
+    struct stat st;
+    void* data;
+
+    if (fd < 0)
+        return SDL_FALSE;
+
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            pack->data = data;
+            pack->size = st.st_size;
+        }
     }
+    close(fd);
+#endif
 
-    *refX = (srcX-dstX);
-    *refX /= steps;
-    *refY = (srcY-dstY);
-    *refY /= steps;
-}
+    if (pack->data == NULL) {
+        printf("Failed to map %s, loading loose files\n", ASSET_PACK);
+        return SDL_FALSE;
+    }
 
-static void capFrameRate(long *then, float *remainder) {
-    long wait, frameTime;
-    wait = 16 + *remainder;
+    header = (const PackHeader*)pack->data;
+    tables = sizeof(PackHeader) + sizeof(PackPage) * ATLAS_MAX_PAGES
+        + sizeof(PackSprite) * SPR_MAX + sizeof(PackSound) * SND_MAX;
+
+    // Sizing the check for the most pages keeps it from reading past a short file
+    if (pack->size < tables || memcmp(header->magic, PACK_MAGIC, 4) != 0
+        || header->version != PACK_VERSION || header->pages == 0 || header->pages > ATLAS_MAX_PAGES
+        || header->sprites != SPR_MAX || header->sounds != SND_MAX) {
+        printf("%s is stale or not an asset pack, loading loose files\n", ASSET_PACK);
+        pack_close();
+        return SDL_FALSE;
+    }
 
-    *remainder -= (int)*remainder;
+    pack->header = header;
+    pack->pages = (const PackPage*)(header + 1);
+    pack->sprites = (const PackSprite*)(pack->pages + header->pages);
+    pack->sounds = (const PackSound*)(pack->sprites + header->sprites);
+
+    for (i = 0; i < header->pages; i++) {
+        if (pack->pages[i].offset > pack->size || pack->pages[i].size > pack->size - pack->pages[i].offset
+            || pack->pages[i].size != (Uint64)pack->pages[i].w * pack->pages[i].h * 4) {
+            printf("%s page %u is truncated, loading loose files\n", ASSET_PACK, i);
+            pack_close();
+            return SDL_FALSE;
+        }
+    }
 
-    frameTime = SDL_GetTicks() - *then;
+    // Sprites must lie on one of the pages
+    for (i = 0; i < header->sprites; i++) {
+        sprite = &pack->sprites[i];
+        if (sprite->page >= header->pages || sprite->rect.x < 0 || sprite->rect.y < 0
+            || sprite->rect.w <= 0 || sprite->rect.h <= 0
+            || (Uint32)sprite->rect.x > pack->pages[sprite->page].w
+            || (Uint32)sprite->rect.y > pack->pages[sprite->page].h
+            || (Uint32)sprite->rect.w > pack->pages[sprite->page].w - sprite->rect.x
+            || (Uint32)sprite->rect.h > pack->pages[sprite->page].h - sprite->rect.y) {
+            printf("%s sprite %u is off its page, loading loose files\n", ASSET_PACK, i);
+            pack_close();
+            return SDL_FALSE;
+        }
+    }
 
-    wait -= frameTime;
-    if (wait < 1) {
-        wait = 1;
+    for (i = 0; i < header->sounds; i++) {
+        if (pack->sounds[i].offset > pack->size || pack->sounds[i].size > pack->size - pack->sounds[i].offset) {
+            printf("%s sound %u is truncated, loading loose files\n", ASSET_PACK, i);
+            pack_close();
+            return SDL_FALSE;
+        }
     }
-    SDL_Delay(wait);
 
-    *remainder += 0.667;
+    SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO,
+        "Mapped %s, %lu bytes", ASSET_PACK, (unsigned long)pack->size);
 
-    *then = SDL_GetTicks();
+    return SDL_TRUE;
 }
 
-int main(int argc, char* argv[]) {
+static void pack_close(void) {
+    Pack* pack = Game.pack;
 
-    long then;
-    float remainder;
+    if (pack->data != NULL) {
+#if defined(_WIN32)
+        UnmapViewOfFile(pack->data);
+        CloseHandle(pack->handle);
+#else
+        munmap(pack->data, pack->size);
+#endif
+    }
 
-    Game.init();
+    pack->data = NULL;
+    pack->handle = NULL;
+    pack->size = 0;
+    pack->header = NULL;
+}
+
+// Sprite rects come from the pack and each page goes to the texture as it
+// lies in the mapping. Falls back when a page is over the renderer's limit.
+static SDL_bool pack_load_atlas(void) {
+    Atlas* atlas = &Game.graphics->atlas;
+    const PackPage* page;
+    SDL_RendererInfo info;
+    Sprite* s;
+    Uint32 i;
+
+    if (!pack_open())
+        return SDL_FALSE;
+
+    if (!Game.headless && SDL_GetRendererInfo(Game.screen->renderer, &info) == 0 && info.max_texture_width > 0) {
+        for (i = 0; i < Game.pack->header->pages; i++) {
+            page = &Game.pack->pages[i];
+            if ((int)page->w > info.max_texture_width || (int)page->h > info.max_texture_height) {
+                printf("%s pages are too large for this renderer, loading loose files\n", ASSET_PACK);
+                return SDL_FALSE;
+            }
+        }
+    }
+
+    for (i = 0; i < SPR_MAX; i++) {
+        s = &atlas->sprites[i];
+        s->filename = spriteFiles[i];
+        s->page = Game.pack->sprites[i].page;
+        s->rect = Game.pack->sprites[i].rect;
+        s->blend = sprite_blend(i);
+    }
+
+    atlas->pageCount = Game.pack->header->pages;
+
+    for (i = 0; i < Game.pack->header->pages; i++) {
+        page = &Game.pack->pages[i];
+        atlas->pageW[i] = page->w;
+        atlas->pageH[i] = page->h;
+        atlas->surfaces[i] = NULL;
+        atlas->pages[i] = NULL;
+
+        // Headless runs only need the sprite sizes
+        if (Game.headless)
+            continue;
+
+        atlas->pages[i] = SDL_CreateTexture(Game.screen->renderer, SDL_PIXELFORMAT_RGBA32,
+            SDL_TEXTUREACCESS_STATIC, page->w, page->h);
+        if (atlas->pages[i] == NULL) {
+            printf("Failed to create atlas page %u! SDL Error: %s\n", i, SDL_GetError());
+            exit(1);
+        }
+
+        if (SDL_UpdateTexture(atlas->pages[i], NULL, Game.pack->data + page->offset, page->w * 4) != 0) {
+            printf("Failed to upload atlas page %u! SDL Error: %s\n", i, SDL_GetError());
+            exit(1);
+        }
+        render_texture_blend(atlas->pages[i], SDL_BLENDMODE_BLEND);
+    }
+
+    SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO,
+        "Loaded %d sprites in %d atlas page(s) from %s", SPR_MAX, atlas->pageCount, ASSET_PACK);
+
+    return SDL_TRUE;
+}
+
+// Chunks play the PCM in place, which only works if the mixer opened with
+// the format the pack was baked for
+static SDL_bool pack_load_sounds(void) {
+    const PackHeader* header;
+    int frequency, channels;
+    Uint16 format;
+    int i;
+
+    if (!pack_open())
+        return SDL_FALSE;
+
+    header = Game.pack->header;
+
+    if (Mix_QuerySpec(&frequency, &format, &channels) == 0
+        || frequency != header->frequency || format != header->format || channels != header->channels) {
+        printf("Mixer format does not match %s, loading loose sounds\n", ASSET_PACK);
+        return SDL_FALSE;
+    }
+
+    for (i = 0; i < SND_MAX; i++) {
+        Game.sounds->sounds[i] = Mix_QuickLoad_RAW(Game.pack->data + Game.pack->sounds[i].offset, Game.pack->sounds[i].size);
+        if (Game.sounds->sounds[i] == NULL) {
+            printf("Failed to load sound %s from %s! SDL Error %s\n", soundFiles[i], ASSET_PACK, SDL_GetError());
+            exit(1);
+        }
+    }
+
+    return SDL_TRUE;
+}
+
+// The blit function simply draws the specified sprite on screen
+// at specified x and y coordinates
+static void blit(int sprite, int x, int y) {
+    SDL_Color white = { 255, 255, 255, 255 };
+    Sprite* s = &Game.graphics->atlas.sprites[sprite];
+
+    batch_quad(batch_bind_sprite(s), &s->rect, x, y, s->rect.w, s->rect.h, white);
+}
+static void blitRect(int sprite, SDL_Rect* src, int x, int y) {
+    SDL_Color white = { 255, 255, 255, 255 };
+
+    Game.graphics->blitColor(sprite, src, x, y, white);
+}
+
+// Same as blitRect but tinted by color, a NULL src draws the whole sprite.
+// src is relative to the sprite, not the atlas page.
+static void blitColor(int sprite, SDL_Rect* src, int x, int y, SDL_Color color) {
+    Sprite* s = &Game.graphics->atlas.sprites[sprite];
+    SDL_Rect rect = s->rect;
+
+    if (src != NULL) {
+        rect.x += src->x;
+        rect.y += src->y;
+        rect.w = src->w;
+        rect.h = src->h;
+    }
+
+    batch_quad(batch_bind_sprite(s), &rect, x, y, rect.w, rect.h, color);
+}
+
+// Every blit is recorded into one sprite batch. When the batch fills up
+// or something is about to draw straight to the renderer, the recorded
+// commands are sorted by layer, blend mode and texture and each run of
+// equal state goes out in a single SDL_RenderGeometry call.
+static void batch_init(void) {
+    SpriteBatch* batch = &Game.graphics->batch;
+
+    batch->capacity = BATCH_MAX_QUADS;
+    batch->vertices = MEM_ALLOC(MEM_BATCH, batch->capacity * 4 * sizeof(SDL_Vertex));
+    batch->indices = MEM_ALLOC(MEM_BATCH, batch->capacity * 6 * sizeof(int));
+    // A command holds at least one quad
+    batch->commands = MEM_ALLOC(MEM_BATCH, batch->capacity * sizeof(DrawCommand));
+    batch->sorted = MEM_ALLOC(MEM_BATCH, batch->capacity * sizeof(DrawCommand));
+    if (batch->vertices == NULL || batch->indices == NULL || batch->commands == NULL || batch->sorted == NULL) {
+        printf("Failed to allocate sprite batch!\n");
+        exit(1);
+    }
+
+    batch->texture = NULL;
+    batch->quads = 0;
+    batch->commandCount = 0;
+    batch->key = batch_key(batch);
+}
+
+// Packs the layer, blend mode and texture quads are recorded with into a
+// key, layer in the top byte and the blend mode and texture indices in
+// the low ones. batch_record adds an order within the layer in between.
+// Within a layer the order is only kept per state, A B A draws as A A B,
+// unless the layer is one of DRAW_IN_ORDER.
+static Uint32 batch_key(SpriteBatch* batch) {
+    int t, b;
+
+    for (t = 0; t < batch->textureCount && batch->textures[t] != batch->texture; t++);
+    for (b = 0; b < batch->blendCount && batch->blends[b] != batch->blend; b++);
+
+    // Recorded quads refer to the tables, they go out before the tables
+    // can be emptied
+    if (t == DRAW_MAX_TEXTURES || b == DRAW_MAX_BLENDS || batch->stateCount == DRAW_MAX_STATES) {
+        batch_flush();
+        t = b = 0;
+    }
+
+    if (t == batch->textureCount) {
+        batch->textures[batch->textureCount++] = batch->texture;
+    }
+    if (b == batch->blendCount) {
+        batch->blends[batch->blendCount++] = batch->blend;
+    }
+
+    return (Uint32)batch->layer << 24 | (Uint32)b << 8 | (Uint32)t;
+}
+
+// Sets the texture and blend mode of the quads recorded next, w and h are
+// the texture's size for working out texture coordinates
+static SpriteBatch* batch_bind(SDL_Texture* texture, int w, int h, SDL_BlendMode blend) {
+    SpriteBatch* batch = &Game.graphics->batch;
+
+    if (texture != batch->texture || blend != batch->blend) {
+        batch->texture = texture;
+        batch->textureW = w;
+        batch->textureH = h;
+        batch->blend = blend;
+        batch->key = batch_key(batch);
+    }
+
+    return batch;
+}
+
+static SpriteBatch* batch_bind_sprite(Sprite* s) {
+    Atlas* atlas = &Game.graphics->atlas;
+
+    return batch_bind(atlas->pages[s->page], atlas->pageW[s->page], atlas->pageH[s->page], s->blend);
+}
+
+// Quads recorded from here on are drawn after those of lower layers
+static void batch_layer(int layer) {
+    SpriteBatch* batch = &Game.graphics->batch;
+
+    batch->layer = layer;
+    batch->key = batch_key(batch);
+}
+
+// Takes the n quads written after the recorded ones into the last
+// command, or starts a new one when the state changed since. A new
+// command's key gets the order its state was first drawn in the layer, so
+// sorting keeps each layer's states in the order they were drawn
+// whichever layers were drawn in between. In DRAW_IN_ORDER layers every
+// command counts as a state of its own and keeps its place.
+static void batch_record(SpriteBatch* batch, int n) {
+    int last = batch->commandCount - 1;
+    int s;
+
+    if (last >= 0 && (batch->commands[last].key & ~DRAW_ORDER_MASK) == batch->key) {
+        batch->commands[last].quads += n;
+    } else {
+        s = batch->stateCount;
+        if ((DRAW_IN_ORDER & 1u << batch->layer) == 0) {
+            for (s = 0; s < batch->stateCount && batch->states[s] != batch->key; s++);
+        }
+        if (s == batch->stateCount) {
+            batch->states[batch->stateCount++] = batch->key;
+        }
+
+        batch->commands[batch->commandCount++] = (DrawCommand) { batch->key | (Uint32)s << 16, batch->quads, n };
+    }
+
+    batch->quads += n;
+}
+
+static void batch_quad(SpriteBatch* batch, const SDL_Rect* src, float x, float y, float w, float h, SDL_Color color) {
+    if (batch->quads == batch->capacity) {
+        batch_flush();
+    }
+
+    make_quad(&batch->vertices[batch->quads * 4], src, x, y, w, h, color, batch->textureW, batch->textureH);
+    batch_record(batch, 1);
+}
+
+// Appends quads that were laid out ahead of time, moved by x and y. They
+// must use the texture the batch is bound to.
+static void batch_vertices(SpriteBatch* batch, const SDL_Vertex* vertices, int quads, float x, float y) {
+    SDL_Vertex* v;
+    int i, n;
+
+    while (quads > 0) {
+        if (batch->quads == batch->capacity) {
+            batch_flush();
+        }
+
+        n = MIN(quads, batch->capacity - batch->quads);
+        v = &batch->vertices[batch->quads * 4];
+
+        for (i = 0; i < n * 4; i++) {
+            v[i] = vertices[i];
+            v[i].position.x += x;
+            v[i].position.y += y;
+        }
+
+        batch_record(batch, n);
+        vertices += n * 4;
+        quads -= n;
+    }
+}
+
+// Fills the four corners of a quad, src is in texels of a w by h texture
+static void make_quad(SDL_Vertex* v, const SDL_Rect* src, float x, float y, float w, float h, SDL_Color color, int textureW, int textureH) {
+    float u0 = (float)src->x / textureW;
+    float v0 = (float)src->y / textureH;
+    float u1 = (float)(src->x + src->w) / textureW;
+    float v1 = (float)(src->y + src->h) / textureH;
+
+    v[0].position.x = x;     v[0].position.y = y;     v[0].tex_coord.x = u0; v[0].tex_coord.y = v0;
+    v[1].position.x = x + w; v[1].position.y = y;     v[1].tex_coord.x = u1; v[1].tex_coord.y = v0;
+    v[2].position.x = x;     v[2].position.y = y + h; v[2].tex_coord.x = u0; v[2].tex_coord.y = v1;
+    v[3].position.x = x + w; v[3].position.y = y + h; v[3].tex_coord.x = u1; v[3].tex_coord.y = v1;
+    v[0].color = v[1].color = v[2].color = v[3].color = color;
+}
+
+// Stable LSD radix sort of the commands by key, a byte at a time. Bytes
+// all keys share are skipped, a frame drawn with few states sorts in a
+// pass or two. Returns whichever buffer ended up holding the result.
+static DrawCommand* batch_sort(SpriteBatch* batch) {
+    DrawCommand* src = batch->commands;
+    DrawCommand* dst = batch->sorted;
+    DrawCommand* swap;
+    int count[256];
+    int i, shift, digit, sum, n;
+
+    for (shift = 0; shift < 32; shift += 8) {
+        memset(count, 0, sizeof(count));
+        for (i = 0; i < batch->commandCount; i++) {
+            count[(src[i].key >> shift) & 0xFF]++;
+        }
+
+        if (count[(src[0].key >> shift) & 0xFF] == batch->commandCount) {
+            continue;
+        }
+
+        for (digit = 0, sum = 0; digit < 256; digit++) {
+            n = count[digit];
+            count[digit] = sum;
+            sum += n;
+        }
+
+        for (i = 0; i < batch->commandCount; i++) {
+            dst[count[(src[i].key >> shift) & 0xFF]++] = src[i];
+        }
+
+        swap = src;
+        src = dst;
+        dst = swap;
+    }
+
+    return src;
+}
+
+// Counts the texture and blend mode changes drawing the commands in this
+// order takes, the layer and order alone do not change any renderer state
+static void batch_changes(DrawCommand* commands, int count, long* textures, long* blends) {
+    Uint32 last = 0xFFFFFFFF;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if ((commands[i].key & 0xFF) != (last & 0xFF)) {
+            (*textures)++;
+        }
+        if ((commands[i].key & 0xFF00) != (last & 0xFF00)) {
+            (*blends)++;
+        }
+        last = commands[i].key;
+    }
+}
+
+static void batch_flush(void) {
+    SpriteBatch* batch = &Game.graphics->batch;
+    DrawCommand* commands;
+    Uint32 state;
+    int i, j, q, n, *idx;
+
+    if (batch->quads == 0) {
+        return;
+    }
+
+    batch_changes(batch->commands, batch->commandCount, &batch->unsortedTextureChanges, &batch->unsortedBlendChanges);
+    commands = batch_sort(batch);
+    batch_changes(commands, batch->commandCount, &batch->textureChanges, &batch->blendChanges);
+
+    // Sorted runs of the same texture and blend mode go out together even
+    // when they sit in different layers, the indices pick their quads out
+    // of the recorded vertices
+    for (i = 0; i < batch->commandCount; i = j) {
+        state = commands[i].key & 0xFFFF;
+
+        for (j = i, n = 0, idx = batch->indices; j < batch->commandCount && (commands[j].key & 0xFFFF) == state; j++) {
+            for (q = commands[j].first; q < commands[j].first + commands[j].quads; q++, idx += 6) {
+                // Quads are always two triangles over the same corners
+                idx[0] = q * 4;
+                idx[1] = q * 4 + 1;
+                idx[2] = q * 4 + 2;
+                idx[3] = q * 4 + 2;
+                idx[4] = q * 4 + 1;
+                idx[5] = q * 4 + 3;
+            }
+            n += commands[j].quads;
+        }
+
+        // Atlas pages are shared by sprites with different blend modes
+        render_texture_blend(batch->textures[state & 0xFF], batch->blends[state >> 8]);
+        render_geometry(batch->textures[state & 0xFF],
+            batch->vertices, batch->quads * 4,
+            batch->indices, n * 6);
+
+        batch->flushes++;
+    }
+
+    batch->submitted += batch->quads;
+    batch->quads = 0;
+    batch->commandCount = 0;
+
+    batch->textureCount = 0;
+    batch->blendCount = 0;
+    batch->stateCount = 0;
+    batch->key = batch_key(batch);
+}
+
+static void print_batch_stats(void) {
+    SpriteBatch* batch = &Game.graphics->batch;
+
+    SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO,
+        "Batch quads %ld draw calls %ld texture changes %ld (%ld unsorted) blend changes %ld (%ld unsorted)",
+        batch->submitted, batch->flushes, batch->textureChanges, batch->unsortedTextureChanges,
+        batch->blendChanges, batch->unsortedBlendChanges);
+}
+
+// Every renderer call in the game goes through the render_* wrappers so a
+// frame's work on the renderer can be counted. Clears count as draw calls
+// but do not draw with a texture or blend mode.
+static void render_draw(SDL_Texture* texture, SDL_BlendMode blend, long quads) {
+    RenderStats* stats = &Game.graphics->stats;
+
+    stats->current.drawCalls++;
+    stats->current.quads += quads;
+
+    if (texture != stats->texture) {
+        stats->current.textureSwitches++;
+        stats->texture = texture;
+    }
+    if (blend != stats->blend) {
+        stats->current.blendSwitches++;
+        stats->blend = blend;
+    }
+}
+
+static void render_color(Uint8 r, Uint8 g, Uint8 b, Uint8 a) {
+    Game.graphics->stats.current.stateChanges++;
+    SDL_SetRenderDrawColor(Game.screen->renderer, r, g, b, a);
+}
+
+static void render_draw_blend(SDL_BlendMode blend) {
+    Game.graphics->stats.current.stateChanges++;
+    Game.graphics->stats.drawBlend = blend;
+    SDL_SetRenderDrawBlendMode(Game.screen->renderer, blend);
+}
+
+static int render_texture_blend(SDL_Texture* texture, SDL_BlendMode blend) {
+    Game.graphics->stats.current.stateChanges++;
+    return SDL_SetTextureBlendMode(texture, blend);
+}
+
+static void render_target(SDL_Texture* texture) {
+    Game.graphics->stats.current.stateChanges++;
+    SDL_SetRenderTarget(Game.screen->renderer, texture);
+}
+
+static void render_clear(void) {
+    Game.graphics->stats.current.drawCalls++;
+    SDL_RenderClear(Game.screen->renderer);
+}
+
+static void render_fill_rect(const SDL_Rect* rect) {
+    render_draw(NULL, Game.graphics->stats.drawBlend, 1);
+    SDL_RenderFillRect(Game.screen->renderer, rect);
+}
+
+static void render_fill_rects(const SDL_Rect* rects, int count) {
+    render_draw(NULL, Game.graphics->stats.drawBlend, count);
+    SDL_RenderFillRects(Game.screen->renderer, rects, count);
+}
+
+static void render_line(int x1, int y1, int x2, int y2) {
+    render_draw(NULL, Game.graphics->stats.drawBlend, 0);
+    SDL_RenderDrawLine(Game.screen->renderer, x1, y1, x2, y2);
+}
+
+// Only the loading bar draws outlines
+#ifndef TIGER_NO_MAIN
+static void render_rect(const SDL_Rect* rect) {
+    render_draw(NULL, Game.graphics->stats.drawBlend, 0);
+    SDL_RenderDrawRect(Game.screen->renderer, rect);
+}
+#endif
+
+static void render_geometry(SDL_Texture* texture, const SDL_Vertex* vertices, int vertexCount, const int* indices, int indexCount) {
+    SDL_BlendMode blend = SDL_BLENDMODE_NONE;
+
+    SDL_GetTextureBlendMode(texture, &blend);
+    render_draw(texture, blend, indexCount / 6);
+    SDL_RenderGeometry(Game.screen->renderer, texture, vertices, vertexCount, indices, indexCount);
+}
+
+static void render_present(void) {
+    render_stats_frame();
+    SDL_RenderPresent(Game.screen->renderer);
+}
+
+// Closes the frame's counters, and writes them out with --render-stats
+static void render_stats_frame(void) {
+    RenderStats* stats = &Game.graphics->stats;
+    SpriteBatch* batch = &Game.graphics->batch;
+    RenderFrame* frame = &stats->current;
+    long spared;
+
+    spared = batch->unsortedTextureChanges - batch->textureChanges;
+    frame->sortedTextureSwitches = spared - stats->batchTextureSpared;
+    stats->batchTextureSpared = spared;
+
+    spared = batch->unsortedBlendChanges - batch->blendChanges;
+    frame->sortedBlendSwitches = spared - stats->batchBlendSpared;
+    stats->batchBlendSpared = spared;
+
+    if (stats->csv != NULL) {
+        fprintf(stats->csv, "%ld,%ld,%ld,%ld,%ld,%ld,%ld,%ld\n", stats->frames,
+            frame->drawCalls, frame->quads, frame->textureSwitches, frame->blendSwitches,
+            frame->stateChanges, frame->sortedTextureSwitches, frame->sortedBlendSwitches);
+    }
+
+    stats->total.drawCalls += frame->drawCalls;
+    stats->total.quads += frame->quads;
+    stats->total.textureSwitches += frame->textureSwitches;
+    stats->total.blendSwitches += frame->blendSwitches;
+    stats->total.stateChanges += frame->stateChanges;
+    stats->total.sortedTextureSwitches += frame->sortedTextureSwitches;
+    stats->total.sortedBlendSwitches += frame->sortedBlendSwitches;
+
+    if (frame->drawCalls > stats->peak.drawCalls) {
+        stats->peak = *frame;
+    }
+
+    stats->last = *frame;
+    stats->frames++;
+    *frame = (RenderFrame) {};
+}
+
+// The counters of the last frame in a panel along the bottom of the screen
+static void render_stats_draw(void) {
+    RenderStats* stats = &Game.graphics->stats;
+    RenderFrame* last = &stats->last;
+    SDL_Rect panel = { 10, SCREEN_H - RENDER_STATS_LINES * GLYPH_H - 30, SCREEN_W - 20, RENDER_STATS_LINES * GLYPH_H + 20 };
+    int x = panel.x + 10, y = panel.y + 10;
+
+    if (!stats->visible || stats->frames == 0) {
+        return;
+    }
+
+    Game.graphics->flush();
+    batch_layer(DRAW_OVERLAY);
+
+    render_draw_blend(SDL_BLENDMODE_BLEND);
+    render_color(0, 0, 0, 192);
+    render_fill_rect(&panel);
+    render_draw_blend(SDL_BLENDMODE_NONE);
+
+    Game.text->draw_text(x, y, 255, 255, 255, "DRAWS %ld QUADS %ld", last->drawCalls, last->quads);
+    Game.text->draw_text(x, y + GLYPH_H, 255, 255, 255, "TEX %ld BLEND %ld STATE %ld",
+        last->textureSwitches, last->blendSwitches, last->stateChanges);
+    Game.text->draw_text(x, y + GLYPH_H * 2, 255, 255, 255, "SORT SAVED TEX %ld BLEND %ld",
+        last->sortedTextureSwitches, last->sortedBlendSwitches);
+    Game.text->draw_text(x, y + GLYPH_H * 3, 255, 96, 96, "PEAK DRAWS %ld QUADS %ld",
+        stats->peak.drawCalls, stats->peak.quads);
+
+    Game.graphics->flush();
+}
+
+static void print_render_stats(void) {
+    RenderStats* stats = &Game.graphics->stats;
+
+    if (stats->frames == 0) {
+        return;
+    }
+
+    SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO,
+        "Render frames %ld, per frame draw calls %.1f (peak %ld) quads %.1f texture switches %.1f blend switches %.1f state changes %.1f",
+        stats->frames, (double)stats->total.drawCalls / stats->frames, stats->peak.drawCalls,
+        (double)stats->total.quads / stats->frames, (double)stats->total.textureSwitches / stats->frames,
+        (double)stats->total.blendSwitches / stats->frames, (double)stats->total.stateChanges / stats->frames);
+}
+
+
+static void do_key_up(SDL_KeyboardEvent* event) {
+    // check if the keyboard event was a result of  Keyboard repeat event
+    if (event->repeat == 0 && event->keysym.scancode < MAX_KEYBOARD_KEYS) {
+        SDL_AtomicLock(&Game.input->lock);
+        Game.input->held[event->keysym.scancode] = 0;
+        SDL_AtomicUnlock(&Game.input->lock);
+    }
+}
+
+static void do_key_down(SDL_KeyboardEvent* event) {
+    // check if the keyboard event was a result of  Keyboard repeat event
+    if (event->repeat == 0 && event->keysym.scancode < MAX_KEYBOARD_KEYS) {
+        SDL_AtomicLock(&Game.input->lock);
+        Game.input->held[event->keysym.scancode] = 1;
+        SDL_AtomicUnlock(&Game.input->lock);
+    }
+
+    if (event->repeat == 0 && event->keysym.scancode == SDL_SCANCODE_F3) {
+        Game.profiler->visible = !Game.profiler->visible;
+    }
+
+    if (event->repeat == 0 && event->keysym.scancode == SDL_SCANCODE_F4) {
+        Game.graphics->stats.visible = !Game.graphics->stats.visible;
+    }
+}
+
+static void draw(void) {
+    PROFILE_ZONE(ZONE_DRAW_BACKGROUND, draw_background());
+    PROFILE_ZONE(ZONE_DRAW_STARFIELD, draw_startfield());
+    PROFILE_ZONE(ZONE_DRAW_PLAYER, draw_player());
+    PROFILE_ZONE(ZONE_DRAW_BULLETS, draw_bullets());
+    PROFILE_ZONE(ZONE_DRAW_ENEMY_BULLETS, draw_enemy_bullets());
+    PROFILE_ZONE(ZONE_DRAW_ENEMY, draw_enemy());
+    PROFILE_ZONE(ZONE_DRAW_DEBRIS, draw_debris());
+    PROFILE_ZONE(ZONE_DRAW_EXPLOSIONS, draw_explosions());
+    PROFILE_ZONE(ZONE_DRAW_HUD, draw_hud());
+    Game.profiler->draw();
+    render_stats_draw();
+}
+
+static void draw_hud(void) {
+    Snapshot* snap = &Game.snapshots->buffers[Game.snapshots->front];
+    Uint64 key = (Uint64)(Uint32)snap->score << 32 | (Uint32)snap->highscore;
+    SDL_Rect score = { 0, 0, HUD_LAYER_W, GLYPH_H };
+    SDL_Rect highscore = { 0, GLYPH_H, HUD_LAYER_W, GLYPH_H };
+
+    batch_layer(DRAW_HUD);
+
+    // The score lines sit one above the other in a layer just big enough
+    // for them, and are only redrawn into it when one of them changes
+    if (cache_begin(CACHE_HUD, key)) {
+        Game.text->draw_text(0, score.y, 255, 255, 255, "SCORE: %03d", snap->score);
+
+        if (snap->score > 0 && snap->score == snap->highscore) {
+            Game.text->draw_text(0, highscore.y, 0, 255, 0, "HIGH SCORE: %03d", snap->highscore);
+        } else {
+            Game.text->draw_text(0, highscore.y, 255, 255, 255, "HIGH SCORE: %03d", snap->highscore);
+        }
+
+        cache_end();
+    }
+
+    cache_draw(CACHE_HUD, &score, 10, 10);
+    cache_draw(CACHE_HUD, &highscore, 10, SCREEN_H - 10 - GLYPH_H);
+
+    Game.text->draw_text(SCREEN_W - (5*GLYPH_W) - 10, 10, 255,0,0, "%.2f", Game.elapsed);
+}
+
+static void draw_background(void) {
+
+    SDL_Color white = { 255, 255, 255, 255 };
+    Sprite* s = &Game.graphics->atlas.sprites[SPR_BACKGROUND];
+    Snapshot* snap = &Game.snapshots->buffers[Game.snapshots->front];
+    float x;
+
+    batch_layer(DRAW_BACKGROUND);
+
+    // Scrolls one pixel a tick, wrapping every SCREEN_W
+    x = snap->backgroundX + (1 - Game.alpha);
+    if (x > 0) {
+        x -= SCREEN_W;
+    }
+
+    for (; x < SCREEN_W; x += SCREEN_W) {
+        batch_quad(batch_bind_sprite(s), &s->rect, x, 0, SCREEN_W, SCREEN_H, white);
+    }
+}
+
+static void draw_startfield(void) {
+    Snapshot* snap = &Game.snapshots->buffers[Game.snapshots->front];
+    float x;
+    int i;
+
+    render_star_layers(snap->stars, snap->starGeneration);
+    batch_layer(DRAW_STARFIELD);
+
+    for (i = 0; i < STAR_SPEEDS; i++) {
+        // Layers move i + 1 pixels a tick and wrap every SCREEN_W
+        x = snap->starOffset[i] + (i + 1) * (1 - Game.alpha);
+        if (x > 0) {
+            x -= SCREEN_W;
+        }
+
+        cache_draw(CACHE_STARS + i, NULL, x, 0);
+        cache_draw(CACHE_STARS + i, NULL, x + SCREEN_W, 0);
+    }
+}
+
+// Points rendering at a cached layer and clears it when it was drawn with
+// another key or lost its contents. Returns SDL_FALSE when the cached copy
+// is still good, otherwise the caller draws it anew and calls cache_end.
+static SDL_bool cache_begin(int id, Uint64 key) {
+    SDL_Renderer* renderer = Game.screen->renderer;
+    CachedLayer* cache = &Game.graphics->caches[id];
+
+    if (renderer == NULL || (cache->valid && cache->key == key)) {
+        return SDL_FALSE;
+    }
+
+    if (cache->texture == NULL) {
+        cache->texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_TARGET, cache->w, cache->h);
+        if (cache->texture == NULL) {
+            printf("Failed to create %s layer! SDL Error %s\n", cache->name, SDL_GetError());
+            exit(1);
+        }
+
+        // Blending into a cleared target leaves the colors premultiplied,
+        // plain alpha blending would darken the edges a second time
+        cache->blend = SDL_ComposeCustomBlendMode(
+            SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA, SDL_BLENDOPERATION_ADD,
+            SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA, SDL_BLENDOPERATION_ADD);
+        if (render_texture_blend(cache->texture, cache->blend) != 0) {
+            cache->blend = SDL_BLENDMODE_BLEND;
+        }
+    }
+
+    // Whatever is batched belongs to the screen, not to the layer
+    Game.graphics->flush();
+
+    Game.graphics->target = SDL_GetRenderTarget(renderer);
+    render_target(cache->texture);
+    render_color(0, 0, 0, 0);
+    render_clear();
+
+    cache->key = key;
+    cache->valid = SDL_TRUE;
+    cache->rebuilds++;
+
+    return SDL_TRUE;
+}
+
+static void cache_end(void) {
+    Game.graphics->flush();
+    render_target(Game.graphics->target);
+}
+
+// Composites src of a cached layer, or all of it when src is NULL, onto
+// the screen at x and y
+static void cache_draw(int id, const SDL_Rect* src, float x, float y) {
+    SDL_Color white = { 255, 255, 255, 255 };
+    CachedLayer* cache = &Game.graphics->caches[id];
+    SDL_Rect all = { 0, 0, cache->w, cache->h };
+
+    if (cache->texture == NULL) {
+        return;
+    }
+
+    if (src == NULL) {
+        src = &all;
+    }
+
+    batch_quad(batch_bind(cache->texture, cache->w, cache->h, cache->blend), src, x, y, src->w, src->h, white);
+    cache->composites++;
+}
+
+static void caches_invalidate(void) {
+    int i;
+
+    for (i = 0; i < CACHE_MAX; i++) {
+        Game.graphics->caches[i].valid = SDL_FALSE;
+    }
+}
+
+static void caches_destroy(void) {
+    CachedLayer* cache;
+    int i;
+
+    for (i = 0; i < CACHE_MAX; i++) {
+        cache = &Game.graphics->caches[i];
+        SDL_DestroyTexture(cache->texture);
+        cache->texture = NULL;
+        cache->valid = SDL_FALSE;
+    }
+}
+
+static void print_cache_stats(void) {
+    CachedLayer* cache;
+    int i;
+
+    for (i = 0; i < CACHE_MAX; i++) {
+        cache = &Game.graphics->caches[i];
+        SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO,
+            "Layer %-6s %2d rebuilt %6ld composited %8ld",
+            cache->name, i, cache->rebuilds, cache->composites);
+    }
+}
+
+// Draws one layer of the snapshot the renderer holds
+static void draw_layer(int layer) {
+    Snapshot* snap = &Game.snapshots->buffers[Game.snapshots->front];
+    SnapQuad* q;
+    int i;
+
+    batch_layer(DRAW_SNAPSHOT + layer);
+
+    for (i = snap->layers[layer]; i < snap->layers[layer + 1]; i++) {
+        q = &snap->quads[i];
+        Game.graphics->blitColor(q->sprite, q->rect.w ? &q->rect : NULL, lerp(q->px, q->x), lerp(q->py, q->y), q->color);
+    }
+}
+
+static void draw_debris(void) {
+    draw_layer(LAYER_DEBRIS);
+}
+
+static void draw_explosions(void) {
+    draw_layer(LAYER_EXPLOSIONS);
+}
+
+static void draw_player(void) {
+    draw_layer(LAYER_PLAYER);
+}
+
+static void draw_bullets(void) {
+    draw_layer(LAYER_BULLETS);
+}
+
+static void draw_enemy_bullets(void) {
+    draw_layer(LAYER_ENEMY_BULLETS);
+}
+
+static void calc_slope(int srcX, int srcY, int dstX, int dstY, float *refX, float * refY) {
+    int steps = MAX(abs(srcX-dstX), abs(srcY-dstY));
+    if (steps == 0) {
+        *refX = *refY = 0;
+        return;
+    }
+
+    *refX = (srcX-dstX);
+    *refX /= steps;
+    *refY = (srcY-dstY);
+    *refY /= steps;
+}
+
+static EntityStore* entity_store(int kind) {
+    return &Game.entities.stores[kind];
+}
+
+// Hands out a zeroed entity at the end of the store. Pointers into the
+// store are only good until the next spawn or kill, keep the handle.
+static Entity* entity_spawn(EntityStore* store) {
+    Entity* e;
+    int slot;
+
+    if (store->count == store->capacity) {
+        entity_reserve(store, MAX(store->capacity * 2, ENTITY_RESERVE));
+    }
+
+    if (store->freeSlot != -1) {
+        slot = store->freeSlot;
+        store->freeSlot = store->slots[slot];
+    } else {
+        slot = store->slotCount++;
+        store->generations[slot] = 1;
+    }
+
+    store->slots[slot] = store->count;
+
+    e = &store->entities[store->count++];
+    memset(e, 0, sizeof(Entity));
+    e->handle = (Uint32)store->generations[slot] << ENTITY_INDEX_BITS | slot;
+
+    store->stats.spawns++;
+    store->stats.live = store->count;
+    store->stats.peak = MAX(store->stats.peak, store->count);
+
+    return e;
+}
+
+// Swaps the last entity into e's place and retires e's handle
+static void entity_kill(EntityStore* store, Entity* e) {
+    int slot = e->handle & ENTITY_INDEX_MASK;
+    int index = e - store->entities;
+    Entity* last = &store->entities[--store->count];
+
+    // Generation 0 is never handed out, so no handle is 0
+    store->generations[slot] = store->generations[slot] + 1 < ENTITY_GENERATIONS ? store->generations[slot] + 1 : 1;
+    store->slots[slot] = store->freeSlot;
+    store->freeSlot = slot;
+
+    if (e != last) {
+        *e = *last;
+        store->slots[e->handle & ENTITY_INDEX_MASK] = index;
+    }
+
+    store->stats.kills++;
+    store->stats.live = store->count;
+}
+
+// NULL when the entity was killed, even if its slot was reused since
+static Entity* entity_get(EntityStore* store, EntityHandle handle) {
+    Uint32 slot = handle & ENTITY_INDEX_MASK;
+
+    if (slot >= (Uint32)store->slotCount || store->generations[slot] != handle >> ENTITY_INDEX_BITS) {
+        return NULL;
+    }
+
+    return &store->entities[store->slots[slot]];
+}
+
+static void entity_reserve(EntityStore* store, int count) {
+    if (count <= store->capacity) {
+        return;
+    }
+
+    if ((Uint32)count > ENTITY_INDEX_MASK + 1) {
+        printf("Can not have more than %u %s!\n", ENTITY_INDEX_MASK + 1, store->name);
+        sim_fail();
+    }
+
+    store->entities = MEM_REALLOC(MEM_ENTITIES, store->entities, count * sizeof(Entity));
+    store->slots = MEM_REALLOC(MEM_ENTITIES, store->slots, count * sizeof(int));
+    store->generations = MEM_REALLOC(MEM_ENTITIES, store->generations, count * sizeof(Uint16));
+
+    if (!store->entities || !store->slots || !store->generations) {
+        printf("Failed to grow %s to %d entities!\n", store->name, count);
+        sim_fail();
+    }
+
+    store->capacity = store->stats.capacity = count;
+}
+
+// Kills everything, last first so nothing has to move
+static void entity_clear(EntityStore* store) {
+    while (store->count > 0) {
+        entity_kill(store, &store->entities[store->count - 1]);
+    }
+}
+
+static void entity_destroy(EntityStore* store) {
+    MEM_FREE(store->entities);
+    MEM_FREE(store->slots);
+    MEM_FREE(store->generations);
+
+    store->entities = NULL;
+    store->slots = NULL;
+    store->generations = NULL;
+    store->count = store->capacity = store->slotCount = 0;
+    store->freeSlot = -1;
+}
+
+static Entity* get_player(void) {
+    return entity_get(entity_store(ENT_PLAYER), Game.entities.player);
+}
+
+static void print_entity_stats(void) {
+    EntityStats* stats;
+    int i;
+
+    for (i = 0; i < ENT_MAX; i++) {
+        stats = &entity_store(i)->stats;
+        SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO,
+            "Store %-14s live %6d peak %6d capacity %6d spawns %8ld kills %8ld",
+            entity_store(i)->name, stats->live, stats->peak, stats->capacity, stats->spawns, stats->kills);
+    }
+}
+
+static void particles_reserve(Particles* p, int capacity) {
+
+    if (capacity <= p->capacity) {
+        return;
+    }
+
+    p->x = MEM_REALLOC(MEM_PARTICLES, p->x, capacity * sizeof(float));
+    p->y = MEM_REALLOC(MEM_PARTICLES, p->y, capacity * sizeof(float));
+    p->px = MEM_REALLOC(MEM_PARTICLES, p->px, capacity * sizeof(float));
+    p->py = MEM_REALLOC(MEM_PARTICLES, p->py, capacity * sizeof(float));
+    p->dx = MEM_REALLOC(MEM_PARTICLES, p->dx, capacity * sizeof(float));
+    p->dy = MEM_REALLOC(MEM_PARTICLES, p->dy, capacity * sizeof(float));
+    p->life = MEM_REALLOC(MEM_PARTICLES, p->life, capacity * sizeof(float));
+    p->color = MEM_REALLOC(MEM_PARTICLES, p->color, capacity * sizeof(SDL_Color));
+    p->rect = MEM_REALLOC(MEM_PARTICLES, p->rect, capacity * sizeof(SDL_Rect));
+    p->sprite = MEM_REALLOC(MEM_PARTICLES, p->sprite, capacity * sizeof(int));
+
+    if (!p->x || !p->y || !p->px || !p->py || !p->dx || !p->dy || !p->life || !p->color || !p->rect || !p->sprite) {
+        printf("Failed to grow particles to %d!\n", capacity);
+        sim_fail();
+    }
+
+    p->capacity = capacity;
+}
+
+// Makes room for num more particles and returns the index of the first,
+// the caller fills in every field of the new slots
+static int particles_emit(Particles* p, int num) {
+    int first = p->count;
+
+    if (first + num > p->capacity) {
+        particles_reserve(p, MAX(p->capacity * 2, first + num));
+    }
+
+    p->count += num;
+    return first;
+}
+
+// Steps particles start..end, returns whether any of them died
+static int particles_integrate(Particles* p, int start, int end) {
+    int i = start, n = end, dead = 0;
+    float g = p->gravity;
+
+#if defined(__AVX__)
+    __m256 g8 = _mm256_set1_ps(g);
+    __m256 one8 = _mm256_set1_ps(1);
+    __m256 zero8 = _mm256_setzero_ps();
+
+    for (; i + 8 <= n; i += 8) {
+        __m256 x = _mm256_loadu_ps(p->x + i);
+        __m256 y = _mm256_loadu_ps(p->y + i);
+        __m256 dy = _mm256_loadu_ps(p->dy + i);
+        __m256 life = _mm256_sub_ps(_mm256_loadu_ps(p->life + i), one8);
+
+        _mm256_storeu_ps(p->px + i, x);
+        _mm256_storeu_ps(p->py + i, y);
+        _mm256_storeu_ps(p->x + i, _mm256_add_ps(x, _mm256_loadu_ps(p->dx + i)));
+        _mm256_storeu_ps(p->y + i, _mm256_add_ps(y, dy));
+        _mm256_storeu_ps(p->dy + i, _mm256_add_ps(dy, g8));
+        _mm256_storeu_ps(p->life + i, life);
+
+        dead |= _mm256_movemask_ps(_mm256_cmp_ps(life, zero8, _CMP_LE_OQ));
+    }
+#endif
+
+#if defined(__SSE__)
+    __m128 g4 = _mm_set1_ps(g);
+    __m128 one4 = _mm_set1_ps(1);
+    __m128 zero4 = _mm_setzero_ps();
+
+    for (; i + 4 <= n; i += 4) {
+        __m128 x = _mm_loadu_ps(p->x + i);
+        __m128 y = _mm_loadu_ps(p->y + i);
+        __m128 dy = _mm_loadu_ps(p->dy + i);
+        __m128 life = _mm_sub_ps(_mm_loadu_ps(p->life + i), one4);
+
+        _mm_storeu_ps(p->px + i, x);
+        _mm_storeu_ps(p->py + i, y);
+        _mm_storeu_ps(p->x + i, _mm_add_ps(x, _mm_loadu_ps(p->dx + i)));
+        _mm_storeu_ps(p->y + i, _mm_add_ps(y, dy));
+        _mm_storeu_ps(p->dy + i, _mm_add_ps(dy, g4));
+        _mm_storeu_ps(p->life + i, life);
+
+        dead |= _mm_movemask_ps(_mm_cmple_ps(life, zero4));
+    }
+#endif
+
+    for (; i < n; i++) {
+        p->px[i] = p->x[i];
+        p->py[i] = p->y[i];
+        p->x[i] += p->dx[i];
+        p->y[i] += p->dy[i];
+        p->dy[i] += g;
+
+        if (--p->life[i] <= 0) {
+            dead = 1;
+        }
+    }
+
+    return dead;
+}
+
+static void particles_job(void* data, int start, int end) {
+    Particles* p = data;
+
+    if (particles_integrate(p, start, end)) {
+        SDL_AtomicSet(&p->dead, 1);
+    }
+}
+
+// Steps particles from integrated on, the ones before were already stepped
+// by jobs, and removes the dead
+static void particles_update(Particles* p, int integrated) {
+    int dead = particles_integrate(p, integrated, p->count);
+
+    if (SDL_AtomicSet(&p->dead, 0) || dead) {
+        particles_compact(p);
+    }
+}
+
+static void particles_compact(Particles* p) {
+    int i = 0, last;
+
+    while (i < p->count) {
+        if (p->life[i] > 0) {
+            i++;
+            continue;
+        }
+
+        last = --p->count;
+        p->x[i] = p->x[last];
+        p->y[i] = p->y[last];
+        p->px[i] = p->px[last];
+        p->py[i] = p->py[last];
+        p->dx[i] = p->dx[last];
+        p->dy[i] = p->dy[last];
+        p->life[i] = p->life[last];
+        p->color[i] = p->color[last];
+        p->rect[i] = p->rect[last];
+        p->sprite[i] = p->sprite[last];
+    }
+}
+
+static void particles_destroy(Particles* p) {
+    MEM_FREE(p->x);
+    MEM_FREE(p->y);
+    MEM_FREE(p->px);
+    MEM_FREE(p->py);
+    MEM_FREE(p->dx);
+    MEM_FREE(p->dy);
+    MEM_FREE(p->life);
+    MEM_FREE(p->color);
+    MEM_FREE(p->rect);
+    MEM_FREE(p->sprite);
+
+    memset(p, 0, offsetof(Particles, gravity));
+}
+
+static void grid_reserve(Grid* grid, int links) {
+
+    if (links > grid->capacity) {
+        grid->items = MEM_REALLOC(MEM_GRID, grid->items, links * sizeof(int));
+        grid->next = MEM_REALLOC(MEM_GRID, grid->next, links * sizeof(int));
+        grid->spanX = MEM_REALLOC(MEM_GRID, grid->spanX, links * sizeof(int));
+        grid->spanY = MEM_REALLOC(MEM_GRID, grid->spanY, links * sizeof(int));
+
+        if (!grid->items || !grid->next || !grid->spanX || !grid->spanY) {
+            printf("Failed to grow collision grid to %d links!\n", links);
+            sim_fail();
+        }
+
+        grid->capacity = links;
+    }
+}
+
+// Cells covered by an entity's box, clamped to the grid
+static void grid_span(Entity* e, int* x0, int* y0, int* x1, int* y1) {
+    *x0 = MIN(MAX((int)e->x / GRID_CELL, 0), GRID_COLS - 1);
+    *y0 = MIN(MAX((int)e->y / GRID_CELL, 0), GRID_ROWS - 1);
+    *x1 = MIN(MAX((int)(e->x + e->w) / GRID_CELL, 0), GRID_COLS - 1);
+    *y1 = MIN(MAX((int)(e->y + e->h) / GRID_CELL, 0), GRID_ROWS - 1);
+}
+
+static void grid_build(Grid* grid, EntityStore* store) {
+    Entity* e;
+    int x0, y0, x1, y1, x, y, n, c, i;
+
+    for (c = 0; c < GRID_ROWS * GRID_COLS; c++) {
+        grid->cells[c] = -1;
+    }
+
+    grid->count = 0;
+    grid->stats.frameTests = 0;
+    grid->stats.frameAvoided = 0;
+
+    for (i = 0; i < store->count; i++) {
+        e = &store->entities[i];
+        grid_span(e, &x0, &y0, &x1, &y1);
+
+        for (y = y0; y <= y1; y++) {
+            for (x = x0; x <= x1; x++) {
+                if (grid->count == grid->capacity) {
+                    grid_reserve(grid, grid->capacity * 2 + GRID_RESERVE);
+                }
+
+                c = y * GRID_COLS + x;
+                n = grid->count++;
+                grid->items[n] = i;
+                grid->next[n] = grid->cells[c];
+                grid->spanX[n] = x0;
+                grid->spanY[n] = y0;
+                grid->cells[c] = n;
+            }
+        }
+    }
+
+    grid->store = store;
+    grid->entities = store->count;
+}
+
+// Returns the index of the entity that comes first in the store among
+// those colliding with e, the same one a linear scan of the store would
+// have found, or -1. Narrow phase tests run are added to tests.
+static int grid_first_hit(Grid* grid, Entity* e, long* tests) {
+    int hit = -1;
+    int x0, y0, x1, y1, x, y, n, k;
+
+    grid_span(e, &x0, &y0, &x1, &y1);
+
+    for (y = y0; y <= y1; y++) {
+        for (x = x0; x <= x1; x++) {
+            for (n = grid->cells[y * GRID_COLS + x]; n != -1; n = grid->next[n]) {
+                if (MAX(grid->spanX[n], x0) != x || MAX(grid->spanY[n], y0) != y) {
+                    continue;
+                }
+
+                k = grid->items[n];
+                if (hit != -1 && k > hit) {
+                    continue;
+                }
+
+                (*tests)++;
+                if (Game.entities.detect_colision(e, &grid->store->entities[k])) {
+                    hit = k;
+                }
+            }
+        }
+    }
+
+    return hit;
+}
+
+// Adds the tests run by a number of queries to the grid's stats
+static void grid_count(Grid* grid, long tests, int queries) {
+    long avoided = (long)grid->entities * queries - tests;
+
+    grid->stats.tests += tests;
+    grid->stats.avoided += avoided;
+    grid->stats.frameTests += tests;
+    grid->stats.frameAvoided += avoided;
+}
+
+static void grid_destroy(Grid* grid) {
+    MEM_FREE(grid->items);
+    MEM_FREE(grid->next);
+    MEM_FREE(grid->spanX);
+    MEM_FREE(grid->spanY);
+
+    grid->items = grid->next = grid->spanX = grid->spanY = NULL;
+    grid->count = grid->capacity = 0;
+}
+
+static void print_grid_stats(void) {
+    GridStats* enemy = &Game.entities.enemy_grid.stats;
+    GridStats* player = &Game.entities.player_grid.stats;
+
+    SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO,
+        "Grid enemy  tests %10ld avoided %10ld", enemy->tests, enemy->avoided);
+    SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO,
+        "Grid player tests %10ld avoided %10ld", player->tests, player->avoided);
+}
+
+static void jobs_init(void) {
+    Jobs* jobs = Game.jobs;
+    int i;
+
+    jobs->workers = MIN(MAX(SDL_GetCPUCount(), 1), JOB_MAX_WORKERS);
+    jobs->wake = SDL_CreateSemaphore(0);
+    jobs->self = SDL_TLSCreate();
+
+    if (jobs->wake == NULL || jobs->self == 0) {
+        printf("Failed to create job system! SDL Error %s\n", SDL_GetError());
+        exit(1);
+    }
+
+    // Workers know themselves by their queue index plus one
+    SDL_TLSSet(jobs->self, (void*)(intptr_t)1, NULL);
+
+    for (i = 1; i < jobs->workers; i++) {
+        jobs->threads[i] = SDL_CreateThread(jobs_worker, "job worker", (void*)(intptr_t)i);
+        if (jobs->threads[i] == NULL) {
+            printf("Failed to create job worker! SDL Error %s\n", SDL_GetError());
+            exit(1);
+        }
+    }
+}
+
+static void jobs_quit(void) {
+    Jobs* jobs = Game.jobs;
+    int i;
+
+    if (jobs->wake == NULL) {
+        return;
+    }
+
+    SDL_AtomicSet(&jobs->quit, 1);
+    for (i = 1; i < jobs->workers; i++) {
+        SDL_SemPost(jobs->wake);
+    }
+
+    for (i = 1; i < jobs->workers; i++) {
+        SDL_WaitThread(jobs->threads[i], NULL);
+        jobs->threads[i] = NULL;
+    }
+
+    printf("Jobs %d workers executed %d stolen %d\n",
+        jobs->workers, SDL_AtomicGet(&jobs->executed), SDL_AtomicGet(&jobs->stolen));
+
+    SDL_DestroySemaphore(jobs->wake);
+    jobs->wake = NULL;
+    jobs->workers = 1;
+}
+
+static int jobs_worker(void* data) {
+    int self = (int)(intptr_t)data;
+
+    SDL_TLSSet(Game.jobs->self, (void*)(intptr_t)(self + 1), NULL);
+
+    while (!SDL_AtomicGet(&Game.jobs->quit)) {
+        if (!jobs_run_one(self)) {
+            SDL_SemWait(Game.jobs->wake);
+        }
+    }
+
+    return 0;
+}
+
+static int jobs_self(void) {
+    return MAX((int)(intptr_t)SDL_TLSGet(Game.jobs->self) - 1, 0);
+}
+
+// Runs the newest job of our own queue, or steals the oldest one from
+// another worker. Returns 0 when every queue was empty.
+static int jobs_run_one(int self) {
+    Jobs* jobs = Game.jobs;
+    JobQueue* q = &jobs->queues[self];
+    Job job;
+    int i, found = 0;
+
+    SDL_AtomicLock(&q->lock);
+    if (q->bottom != q->top) {
+        job = q->jobs[--q->bottom % JOB_QUEUE_SIZE];
+        found = 1;
+    }
+    if (q->bottom == q->top) {
+        q->bottom = q->top = 0;
+    }
+    SDL_AtomicUnlock(&q->lock);
+
+    for (i = 1; !found && i < jobs->workers; i++) {
+        q = &jobs->queues[(self + i) % jobs->workers];
+
+        SDL_AtomicLock(&q->lock);
+        if (q->bottom != q->top) {
+            job = q->jobs[q->top++ % JOB_QUEUE_SIZE];
+            found = 1;
+        }
+        SDL_AtomicUnlock(&q->lock);
+
+        if (found) {
+            SDL_AtomicAdd(&jobs->stolen, 1);
+        }
+    }
+
+    if (!found) {
+        return 0;
+    }
+
+    job.fn(job.data, job.start, job.end);
+    SDL_AtomicAdd(&jobs->executed, 1);
+    SDL_AtomicAdd(job.pending, -1);
+
+    return 1;
+}
+
+// Queues fn over start..end on this thread's queue, or runs it right away
+// when there are no workers or the queue is full
+static void jobs_submit(SDL_atomic_t* pending, JobFunction fn, void* data, int start, int end) {
+    Jobs* jobs = Game.jobs;
+    JobQueue* q = &jobs->queues[jobs_self()];
+    int queued = 0;
+
+    if (jobs->workers > 1) {
+        SDL_AtomicAdd(pending, 1);
+
+        SDL_AtomicLock(&q->lock);
+        if (q->bottom - q->top < JOB_QUEUE_SIZE) {
+            q->jobs[q->bottom++ % JOB_QUEUE_SIZE] = (Job) { fn, data, start, end, pending };
+            queued = 1;
+        }
+        SDL_AtomicUnlock(&q->lock);
+
+        if (queued) {
+            SDL_SemPost(jobs->wake);
+            return;
+        }
+
+        SDL_AtomicAdd(pending, -1);
+    }
+
+    fn(data, start, end);
+}
+
+// Splits 0..count into slices of at least grain, about four per worker
+static void jobs_parallel_for(SDL_atomic_t* pending, JobFunction fn, void* data, int count, int grain) {
+    int slices = Game.jobs->workers * 4;
+    int size = MAX(grain, (count + slices - 1) / slices);
+    int start;
+
+    if (count <= 0) {
+        return;
+    }
+
+    if (count <= size) {
+        fn(data, 0, count);
+        return;
+    }
+
+    for (start = 0; start < count; start += size) {
+        jobs_submit(pending, fn, data, start, MIN(start + size, count));
+    }
+}
+
+// Helps run jobs until everything counted by pending is done
+static void jobs_wait(SDL_atomic_t* pending) {
+    int self = jobs_self();
+
+    while (SDL_AtomicGet(pending) > 0) {
+        jobs_run_one(self);
+    }
+}
+
+// pack.c bakes assets and never ticks, it leaves out sampling input and
+// playing or recording replays
+#ifndef TIGER_PACK
+
+// Key state only changes between ticks
+static void input_sample(void) {
+    SDL_AtomicLock(&Game.input->lock);
+    memcpy(Game.input->keyboard, Game.input->held, sizeof(Game.input->keyboard));
+    SDL_AtomicUnlock(&Game.input->lock);
+
+    replay_sample(Game.input->keyboard);
+}
+
+#endif
+
+static void write_u32(FILE* file, Uint32 v) {
+    Uint8 b[4] = { v, v >> 8, v >> 16, v >> 24 };
+    fwrite(b, 1, 4, file);
+}
+
+#ifndef TIGER_PACK
+
+static Uint32 read_u32(FILE* file) {
+    Uint8 b[4] = { 0 };
+
+    if (fread(b, 1, 4, file) != 4) {
+        printf("Replay file is truncated!\n");
+        exit(1);
+    }
+
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((Uint32)b[3] << 24);
+}
+
+// Seven bits a byte, high bit set on all but the last
+static void write_varint(FILE* file, Uint32 v) {
+    while (v >= 0x80) {
+        fputc((v & 0x7f) | 0x80, file);
+        v >>= 7;
+    }
+    fputc(v, file);
+}
+
+static Uint32 read_varint(FILE* file) {
+    Uint32 v = 0;
+    int c, shift = 0;
+
+    do {
+        c = fgetc(file);
+        if (c == EOF || shift > 28) {
+            printf("Replay file is truncated!\n");
+            exit(1);
+        }
+        v |= (Uint32)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+
+    return v;
+}
+
+// Reads the next change, or parks it past the end when there is none
+static void replay_next(Replay* rp) {
+    Uint32 delta;
+
+    if (feof(rp->file) || (delta = fgetc(rp->file)) == (Uint32)EOF) {
+        rp->changeTick = rp->ticks;
+        return;
+    }
+
+    ungetc(delta, rp->file);
+    rp->changeTick += read_varint(rp->file);
+    rp->changeMask = read_varint(rp->file);
+}
+
+// Opens a replay for playback and returns the seed it was recorded with
+static Uint32 replay_play(const char* filename) {
+    Replay* rp = Game.replay;
+    char magic[4];
+
+    rp->file = fopen(filename, "rb");
+    if (rp->file == NULL) {
+        printf("Failed to open replay %s!\n", filename);
+        exit(1);
+    }
+
+    if (fread(magic, 1, 4, rp->file) != 4 || memcmp(magic, REPLAY_MAGIC, 4) != 0
+        || read_u32(rp->file) != REPLAY_VERSION) {
+        printf("%s is not a replay this build can play!\n", filename);
+        exit(1);
+    }
+
+    rp->seed = read_u32(rp->file);
+    rp->ticks = read_u32(rp->file);
+    rp->hash = read_u32(rp->file);
+    rp->playing = SDL_TRUE;
+
+    replay_next(rp);
+
+    return rp->seed;
+}
+
+// Called once a tick before the simulation reads the keyboard. Recording
+// logs the mask whenever it changes, playback overwrites the keyboard with
+// the recorded mask until the recording runs out.
+static void replay_sample(int* keyboard) {
+    Replay* rp = Game.replay;
+    Uint32 mask = 0;
+    int i;
+
+    if (rp->playing && rp->tick == rp->ticks) {
+        replay_verify();
+        rp->playing = SDL_FALSE;
+    }
+
+    if (rp->playing) {
+        while (rp->changeTick == rp->tick) {
+            rp->mask = rp->changeMask;
+            replay_next(rp);
+        }
+
+        for (i = 0; i < (int)(sizeof(replayKeys) / sizeof(replayKeys[0])); i++) {
+            keyboard[replayKeys[i]] = (rp->mask >> i) & 1;
+        }
+    } else if (rp->recording) {
+        for (i = 0; i < (int)(sizeof(replayKeys) / sizeof(replayKeys[0])); i++) {
+            mask |= (keyboard[replayKeys[i]] != 0) << i;
+        }
+
+        if (mask != rp->mask) {
+            write_varint(rp->file, rp->tick - rp->changeTick);
+            write_varint(rp->file, mask);
+            rp->changeTick = rp->tick;
+            rp->mask = mask;
+        }
+
+        rp->ticks = rp->tick + 1;
+    }
+
+    rp->tick++;
+}
+
+#endif
+
+// Compares the state after the last recorded tick with the recording
+static void replay_verify(void) {
+    Replay* rp = Game.replay;
+    Uint32 hash = state_hash();
+
+    printf("Replay of %u ticks %s, hash %08x recorded %08x\n",
+        rp->ticks, hash == rp->hash ? "matches" : "diverged", hash, rp->hash);
+}
+
+static void replay_close(void) {
+    Replay* rp = Game.replay;
+
+    if (rp->file == NULL) {
+        return;
+    }
+
+    if (rp->recording) {
+        rp->hash = state_hash();
+
+        fseek(rp->file, 12, SEEK_SET);
+        write_u32(rp->file, rp->ticks);
+        write_u32(rp->file, rp->hash);
+
+        printf("Recorded %u ticks, hash %08x\n", rp->ticks, rp->hash);
+    } else if (rp->playing && rp->tick == rp->ticks) {
+        replay_verify();
+    }
+
+    fclose(rp->file);
+    rp->file = NULL;
+    rp->recording = rp->playing = SDL_FALSE;
+}
+
+static void snapshot_reserve(Snapshot* snap, int capacity) {
+    if (capacity <= snap->capacity) {
+        return;
+    }
+
+    snap->quads = MEM_REALLOC(MEM_SNAPSHOTS, snap->quads, capacity * sizeof(SnapQuad));
+    if (snap->quads == NULL) {
+        printf("Failed to grow snapshot to %d quads!\n", capacity);
+        sim_fail();
+    }
+    snap->capacity = capacity;
+}
+
+// Nothing is captured or handed over in pack.c
+#ifndef TIGER_PACK
+
+// Grows the snapshot's quads as needed, a NULL rect means the whole sprite
+static void snapshot_push(Snapshot* snap, int sprite, SDL_Rect* rect, float px, float py, float x, float y, SDL_Color color) {
+    SnapQuad* q;
+
+    if (snap->count == snap->capacity) {
+        snapshot_reserve(snap, MAX(snap->capacity * 2, ENTITY_RESERVE));
+    }
+
+    q = &snap->quads[snap->count++];
+    q->sprite = sprite;
+    q->rect = rect ? *rect : (SDL_Rect) { 0, 0, 0, 0 };
+    q->px = px;
+    q->py = py;
+    q->x = x;
+    q->y = y;
+    q->color = color;
+}
+
+static void snapshot_entities(Snapshot* snap, EntityStore* store) {
+    SDL_Color white = { 255, 255, 255, 255 };
+    Entity* e;
+    int i;
+
+    for (i = 0; i < store->count; i++) {
+        e = &store->entities[i];
+        snapshot_push(snap, e->sprite, NULL, e->prevX, e->prevY, e->x, e->y, white);
+    }
+}
+
+// Copies what the renderer needs out of the simulation, in draw order
+static void snapshot_capture(Snapshot* snap) {
+    SDL_Color white = { 255, 255, 255, 255 };
+    SDL_Color color;
+    Particles* p;
+    Entity* player = get_player();
+    int i;
+
+    snap->count = 0;
+
+    snap->layers[LAYER_PLAYER] = snap->count;
+    if (player != NULL) {
+        snapshot_push(snap, player->sprite, NULL, player->prevX, player->prevY, player->x, player->y, white);
+    }
+
+    snap->layers[LAYER_BULLETS] = snap->count;
+    snapshot_entities(snap, entity_store(ENT_PLAYER_BULLET));
+
+    snap->layers[LAYER_ENEMY_BULLETS] = snap->count;
+    snapshot_entities(snap, entity_store(ENT_ENEMY_BULLET));
+
+    snap->layers[LAYER_ENEMIES] = snap->count;
+    snapshot_entities(snap, entity_store(ENT_ENEMY));
+
+    snap->layers[LAYER_DEBRIS] = snap->count;
+    p = &Game.scenary.debris;
+    for (i = 0; i < p->count; i++) {
+        snapshot_push(snap, p->sprite[i], &p->rect[i], p->px[i], p->py[i], p->x[i], p->y[i], white);
+    }
+
+    // Explosions fade out with their life
+    snap->layers[LAYER_EXPLOSIONS] = snap->count;
+    p = &Game.scenary.explosions;
+    for (i = 0; i < p->count; i++) {
+        color = p->color[i];
+        color.a = p->life[i];
+        snapshot_push(snap, SPR_EXPLOSION, NULL, p->px[i], p->py[i], p->x[i], p->y[i], color);
+    }
+
+    snap->layers[LAYER_MAX] = snap->count;
+
+    snap->backgroundX = backgroundX;
+    memcpy(snap->starOffset, Game.scenary.starOffset, sizeof(snap->starOffset));
+
+    if (snap->starGeneration != Game.scenary.starGeneration) {
+        memcpy(snap->stars, Game.scenary.stars, sizeof(snap->stars));
+        snap->starGeneration = Game.scenary.starGeneration;
+    }
+
+    snap->score = Game.stage->score;
+    snap->highscore = highscore;
+
+    snap->zones = Game.profiler->sim;
+    memset(&Game.profiler->sim, 0, sizeof(ProfileFrame));
+
+    snap->tick++;
+    snap->time = SDL_GetPerformanceCounter();
+}
+
+// Simulation side: fill the back snapshot and swap it into the middle
+static void snapshot_publish(void) {
+    Snapshots* snaps = Game.snapshots;
+    int prev;
+
+    PROFILE_ZONE(ZONE_SNAPSHOT, snapshot_capture(&snaps->buffers[snaps->back]));
+
+    prev = SDL_AtomicSet(&snaps->middle, snaps->back | SNAPSHOT_FRESH);
+    snaps->back = prev & ~SNAPSHOT_FRESH;
+
+    snaps->published++;
+    if (prev & SNAPSHOT_FRESH) {
+        snaps->dropped++;
+    }
+}
+
+// Render side: trade the front snapshot for the middle one if it is newer
+static Snapshot* snapshot_acquire(void) {
+    Snapshots* snaps = Game.snapshots;
+    Snapshot* snap;
+    int prev, z;
+
+    if (SDL_AtomicGet(&snaps->middle) & SNAPSHOT_FRESH) {
+        prev = SDL_AtomicSet(&snaps->middle, snaps->front);
+        snaps->front = prev & ~SNAPSHOT_FRESH;
+
+        // Ticks show up in the frame that first draws them
+        snap = &snaps->buffers[snaps->front];
+        for (z = 0; z < ZONE_MAX; z++) {
+            Game.profiler->current.zones[z] += snap->zones.zones[z];
+        }
+    }
+
+    return &snaps->buffers[snaps->front];
+}
+
+#endif
+
+static void snapshot_destroy(void) {
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        MEM_FREE(Game.snapshots->buffers[i].quads);
+        Game.snapshots->buffers[i].quads = NULL;
+        Game.snapshots->buffers[i].count = Game.snapshots->buffers[i].capacity = 0;
+    }
+}
+
+static void sim_stop(void) {
+    Snapshots* snaps = Game.snapshots;
+
+    if (snaps->thread == NULL) {
+        return;
+    }
+
+    // Stuck in sim_fail for good, it can't be waited for
+    if (SDL_AtomicGet(&snaps->failed)) {
+        SDL_DetachThread(snaps->thread);
+        snaps->thread = NULL;
+        return;
+    }
+
+    SDL_AtomicSet(&snaps->quit, 1);
+    SDL_WaitThread(snaps->thread, NULL);
+    snaps->thread = NULL;
+
+    printf("Snapshots published %ld dropped %ld\n", snaps->published, snaps->dropped);
+}
+
+// Ends the game after a failure the caller already reported. The
+// simulation thread can't exit itself, Game.quit would wait for it and
+// tear SDL down under the render thread. It leaves the failure for main()
+// and stops for good, returning would go on without what failed.
+static void sim_fail(void) {
+    Snapshots* snaps = Game.snapshots;
+
+    if (snaps->threadId != SDL_ThreadID()) {
+        exit(1);
+    }
+
+    SDL_AtomicSet(&snaps->failed, 1);
+    for (;;) {
+        SDL_Delay(1000);
+    }
+}
+
+// Zones on the render thread go into the current frame, zones on the
+// simulation thread into the next snapshot
+static void profile_begin(int zone) {
+    if (Game.headless) {
+        return;
+    }
+
+    Game.profiler->zoneStart[zone] = SDL_GetPerformanceCounter();
+}
+
+static void profile_end(int zone) {
+    Profiler* prof = Game.profiler;
+    ProfileFrame* frame;
+
+    if (Game.headless) {
+        return;
+    }
+
+    frame = SDL_ThreadID() == prof->renderThread ? &prof->current : &prof->sim;
+    frame->zones[zone] += SDL_GetPerformanceCounter() - prof->zoneStart[zone];
+}
+
+static void profile_begin_frame(void) {
+    Profiler* prof = Game.profiler;
+
+    memset(&prof->current, 0, sizeof(prof->current));
+    prof->frameStart = SDL_GetPerformanceCounter();
+}
+
+static void profile_end_frame(void) {
+    Profiler* prof = Game.profiler;
+
+    prof->current.total = SDL_GetPerformanceCounter() - prof->frameStart;
+    prof->frames[prof->head] = prof->current;
+    prof->head = (prof->head + 1) % PROFILE_FRAMES;
+    prof->count = MIN(prof->count + 1, PROFILE_FRAMES);
+}
+
+static int profile_compare(const void* a, const void* b) {
+    Uint64 x = *(const Uint64*)a, y = *(const Uint64*)b;
+    return (x > y) - (x < y);
+}
+
+// Frame time graph over the last PROFILE_FRAMES frames, its percentiles and
+// which zone took longest in each of the latest slow frames
+static void profile_draw(void) {
+    static SDL_Rect fast[PROFILE_FRAMES], slow[PROFILE_FRAMES];
+    Uint64 sorted[PROFILE_FRAMES];
+    Profiler* prof = Game.profiler;
+    SDL_Rect panel = { 10, 50, PROFILE_FRAMES * 2 + 20, PROFILE_GRAPH_H + (PROFILE_SLOW_SHOWN + 1) * GLYPH_H + 30 };
+    double toMs = 1000.0 / prof->frequency;
+    // The graph tops out at twice the slow frame threshold
+    double scale = PROFILE_GRAPH_H / (PROFILE_SLOW_MS * 2);
+    ProfileFrame* frame;
+    int graphY = panel.y + 10 + PROFILE_GRAPH_H;
+    int i, z, worst, nfast = 0, nslow = 0, shown = 0;
+    double ms;
+
+    if (!prof->visible || prof->count == 0) {
+        return;
+    }
+
+    Game.graphics->flush();
+    batch_layer(DRAW_OVERLAY);
+
+    render_draw_blend(SDL_BLENDMODE_BLEND);
+    render_color(0, 0, 0, 192);
+    render_fill_rect(&panel);
+    render_draw_blend(SDL_BLENDMODE_NONE);
+
+    for (i = 0; i < prof->count; i++) {
+        frame = &prof->frames[(prof->head - prof->count + i + PROFILE_FRAMES) % PROFILE_FRAMES];
+        ms = frame->total * toMs;
+        sorted[i] = frame->total;
+
+        SDL_Rect bar = { panel.x + 10 + i * 2, 0, 2, MIN((int)(ms * scale), PROFILE_GRAPH_H) };
+        bar.y = graphY - bar.h;
+
+        if (ms > PROFILE_SLOW_MS) {
+            slow[nslow++] = bar;
+        } else {
+            fast[nfast++] = bar;
+        }
+    }
+
+    render_color(0, 192, 0, 255);
+    render_fill_rects(fast, nfast);
+    render_color(255, 0, 0, 255);
+    render_fill_rects(slow, nslow);
+
+    // Where one tick's worth of time is
+    render_color(255, 255, 255, 255);
+    render_line(panel.x + 10, graphY - (int)(1000.0 / FPS * scale),
+        panel.x + 10 + PROFILE_FRAMES * 2, graphY - (int)(1000.0 / FPS * scale));
+
+    qsort(sorted, prof->count, sizeof(Uint64), profile_compare);
+    Game.text->draw_text(panel.x + 10, graphY + 10, 255, 255, 255, "P50 %.1f P95 %.1f P99 %.1f MS",
+        sorted[(prof->count - 1) * 50 / 100] * toMs,
+        sorted[(prof->count - 1) * 95 / 100] * toMs,
+        sorted[(prof->count - 1) * 99 / 100] * toMs);
+
+    // Newest slow frames first
+    for (i = prof->count - 1; i >= 0 && shown < PROFILE_SLOW_SHOWN; i--) {
+        frame = &prof->frames[(prof->head - prof->count + i + PROFILE_FRAMES) % PROFILE_FRAMES];
+        if (frame->total * toMs <= PROFILE_SLOW_MS) {
+            continue;
+        }
+
+        worst = 0;
+        for (z = 1; z < ZONE_MAX; z++) {
+            if (frame->zones[z] > frame->zones[worst]) {
+                worst = z;
+            }
+        }
+
+        shown++;
+        Game.text->draw_text(panel.x + 10, graphY + 10 + shown * GLYPH_H, 255, 96, 96, "%5.1f %s %.1f",
+            frame->total * toMs, zoneNames[worst], frame->zones[worst] * toMs);
+    }
+
+    Game.graphics->flush();
+}
+
+// xorshift32, seeded through a multiply so nearby seeds diverge quickly.
+// Only what runs the simulation seeds it, not pack.c.
+#ifndef TIGER_PACK
+static void rng_seed(Uint32 seed) {
+    rngState = seed * 2654435761u;
+    if (rngState == 0) {
+        rngState = 0x9E3779B9u;
+    }
+}
+#endif
+
+// Drop in for rand(), 0..2^31-1
+static int rng_next(void) {
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+
+    return rngState >> 1;
+}
+
+static Uint32 hash_bytes(Uint32 hash, const void* data, size_t len) {
+    const unsigned char* c = data;
+
+    while (len--) {
+        hash = (hash ^ *c++) * 16777619u;
+    }
+
+    return hash;
+}
+
+static Uint32 hash_entity(Uint32 hash, Entity* e) {
+    hash = hash_bytes(hash, &e->x, sizeof(e->x));
+    hash = hash_bytes(hash, &e->y, sizeof(e->y));
+    hash = hash_bytes(hash, &e->dx, sizeof(e->dx));
+    hash = hash_bytes(hash, &e->dy, sizeof(e->dy));
+    hash = hash_bytes(hash, &e->heath, sizeof(e->heath));
+    hash = hash_bytes(hash, &e->reload, sizeof(e->reload));
+    return hash_bytes(hash, &e->sprite, sizeof(e->sprite));
+}
+
+static Uint32 hash_particles(Uint32 hash, Particles* p) {
+    hash = hash_bytes(hash, &p->count, sizeof(p->count));
+    hash = hash_bytes(hash, p->x, p->count * sizeof(float));
+    hash = hash_bytes(hash, p->y, p->count * sizeof(float));
+    hash = hash_bytes(hash, p->dx, p->count * sizeof(float));
+    hash = hash_bytes(hash, p->dy, p->count * sizeof(float));
+    return hash_bytes(hash, p->life, p->count * sizeof(float));
+}
+
+// FNV-1a over everything the simulation owns, equal hashes after the same
+// number of ticks mean two runs went exactly the same way
+static Uint32 state_hash(void) {
+    Uint32 hash = 2166136261u;
+    EntityStore* store;
+    int i, j;
+
+    for (i = 0; i < ENT_MAX; i++) {
+        store = entity_store(i);
+        for (j = 0; j < store->count; j++) {
+            hash = hash_entity(hash, &store->entities[j]);
+        }
+        hash = hash_bytes(hash, &i, sizeof(i));
+    }
+
+    hash = hash_particles(hash, &Game.scenary.explosions);
+    hash = hash_particles(hash, &Game.scenary.debris);
+
+    hash = hash_bytes(hash, Game.scenary.starOffset, sizeof(Game.scenary.starOffset));
+    hash = hash_bytes(hash, &backgroundX, sizeof(backgroundX));
+    hash = hash_bytes(hash, &enemySpawnTimer, sizeof(enemySpawnTimer));
+    hash = hash_bytes(hash, &stageResetTimer, sizeof(stageResetTimer));
+    hash = hash_bytes(hash, &Game.stage->score, sizeof(Game.stage->score));
+    hash = hash_bytes(hash, &highscore, sizeof(highscore));
+    return hash_bytes(hash, &rngState, sizeof(rngState));
+}
+
+// Allocates, grows or with a NULL ptr newly allocates a block for tag,
+// counted against the line it was called from. Returns NULL on failure
+// like realloc.
+static void* mem_realloc(int tag, void* ptr, size_t size, int line) {
+    Memory* mem = Game.memory;
+    MemHeader* header = ptr != NULL ? (MemHeader*)((Uint8*)ptr - MEM_HEADER) : NULL;
+    size_t old = header != NULL ? header->size : 0;
+    MemSite* site = NULL;
+    SDL_bool armed;
+    int i;
+
+    header = realloc(header, size + MEM_HEADER);
+    if (header == NULL) {
+        return NULL;
+    }
+
+    header->size = size;
+    header->tag = tag;
+
+    SDL_AtomicLock(&mem->lock);
+
+    mem->tags[tag].live += size - old;
+    mem->tags[tag].peak = MAX(mem->tags[tag].peak, mem->tags[tag].live);
+    mem->tags[tag].allocs++;
+    mem->live += size - old;
+    mem->peak = MAX(mem->peak, mem->live);
+    mem->tickAllocs++;
+
+    for (i = 0; i < MEM_SITES && site == NULL; i++) {
+        if (mem->sites[i].line == line || mem->sites[i].line == 0) {
+            site = &mem->sites[i];
+        }
+    }
+    if (site != NULL) {
+        site->line = line;
+        site->tag = tag;
+        site->allocs++;
+        site->bytes += size;
+    }
+
+    armed = mem->armed;
+    SDL_AtomicUnlock(&mem->lock);
+
+    // Off the render thread it is simulation work, the workers only run
+    // its jobs
+    if (armed) {
+        printf("Allocated %lu bytes of %s at main.c:%d on the %s thread after warm-up!\n",
+            (unsigned long)size, memTagNames[tag], line,
+            SDL_ThreadID() == Game.profiler->renderThread ? "render" : "simulation");
+        print_memory_stats();
+        fflush(stdout);
+        abort();
+    }
+
+    return (Uint8*)header + MEM_HEADER;
+}
+
+static void mem_free(void* ptr) {
+    Memory* mem = Game.memory;
+    MemHeader* header;
+
+    if (ptr == NULL) {
+        return;
+    }
+
+    header = (MemHeader*)((Uint8*)ptr - MEM_HEADER);
+
+    SDL_AtomicLock(&mem->lock);
+    mem->tags[header->tag].live -= header->size;
+    mem->tags[header->tag].frees++;
+    mem->live -= header->size;
+    SDL_AtomicUnlock(&mem->lock);
+
+    free(header);
+}
+
+static void print_memory_stats(void) {
+    Memory* mem = Game.memory;
+    MemTag* tag;
+    MemSite* site;
+    int i;
+
+    for (i = 0; i < MEM_MAX; i++) {
+        tag = &mem->tags[i];
+        SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO,
+            "Memory %-10s live %10lu peak %10lu allocs %6ld frees %6ld",
+            memTagNames[i], (unsigned long)tag->live, (unsigned long)tag->peak, tag->allocs, tag->frees);
+    }
+
+    for (i = 0; i < MEM_SITES && mem->sites[i].line != 0; i++) {
+        site = &mem->sites[i];
+        SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO,
+            "Memory main.c:%-5d %-10s allocs %6ld bytes %10lu",
+            site->line, memTagNames[site->tag], site->allocs, (unsigned long)site->bytes);
+    }
+
+    SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO,
+        "Memory live %lu peak %lu, at most %ld allocations in a tick, %ld ticks after warm-up allocated",
+        (unsigned long)mem->live, (unsigned long)mem->peak, mem->maxTickAllocs, mem->steadyTicks);
+}
+
+// Copies n bytes between the simulation and a frame at offset at, save
+// picks the direction. Without a frame it only adds up the frame's size.
+static Uint32 rewind_bytes(Uint8* frame, Uint32 at, void* data, Uint32 n, SDL_bool save) {
+    if (frame != NULL && n > 0) {
+        if (save) {
+            memcpy(frame + at, data, n);
+        } else {
+            memcpy(data, frame + at, n);
+        }
+    }
+
+    return at + REWIND_ALIGN(n);
+}
+
+// Walks the arrays that follow a frame's fixed part, saving or restoring
+// them, and returns where the frame ends. Restoring sizes the stores and
+// particles from the fixed part first.
+static Uint32 rewind_walk(Uint8* frame, SDL_bool save) {
+    RewindFrame* f = (RewindFrame*)frame;
+    Particles* particles[2] = { &Game.scenary.explosions, &Game.scenary.debris };
+    EntityStore* store;
+    Particles* p;
+    Uint32 at = REWIND_ALIGN(sizeof(RewindFrame));
+    int i;
+
+    for (i = 0; i < ENT_MAX; i++) {
+        store = entity_store(i);
+
+        if (!save) {
+            entity_reserve(store, MAX(f->entities[i], f->slots[i]));
+            store->count = store->stats.live = f->entities[i];
+            store->slotCount = f->slots[i];
+            store->freeSlot = f->freeSlot[i];
+        }
+
+        at = rewind_bytes(frame, at, store->entities, store->count * sizeof(Entity), save);
+        at = rewind_bytes(frame, at, store->slots, store->slotCount * sizeof(int), save);
+        at = rewind_bytes(frame, at, store->generations, store->slotCount * sizeof(Uint16), save);
+    }
+
+    for (i = 0; i < 2; i++) {
+        p = particles[i];
+
+        if (!save) {
+            particles_reserve(p, f->particles[i]);
+            p->count = f->particles[i];
+        }
+
+        at = rewind_bytes(frame, at, p->x, p->count * sizeof(float), save);
+        at = rewind_bytes(frame, at, p->y, p->count * sizeof(float), save);
+        at = rewind_bytes(frame, at, p->px, p->count * sizeof(float), save);
+        at = rewind_bytes(frame, at, p->py, p->count * sizeof(float), save);
+        at = rewind_bytes(frame, at, p->dx, p->count * sizeof(float), save);
+        at = rewind_bytes(frame, at, p->dy, p->count * sizeof(float), save);
+        at = rewind_bytes(frame, at, p->life, p->count * sizeof(float), save);
+        at = rewind_bytes(frame, at, p->color, p->count * sizeof(SDL_Color), save);
+        at = rewind_bytes(frame, at, p->rect, p->count * sizeof(SDL_Rect), save);
+        at = rewind_bytes(frame, at, p->sprite, p->count * sizeof(int), save);
+    }
+
+    return at;
+}
+
+// Writes the simulation into frame, which rewind_walk(NULL, SDL_TRUE) says
+// is big enough
+static Uint32 rewind_save(Uint8* frame) {
+    RewindFrame* f = (RewindFrame*)frame;
+    int i;
+
+    f->rngState = rngState;
+    f->backgroundX = backgroundX;
+    f->enemySpawnTimer = enemySpawnTimer;
+    f->stageResetTimer = stageResetTimer;
+    f->score = Game.stage->score;
+    f->highscore = highscore;
+    f->player = Game.entities.player;
+    memcpy(f->starOffset, Game.scenary.starOffset, sizeof(f->starOffset));
+    memcpy(f->stars, Game.scenary.stars, sizeof(f->stars));
+
+    for (i = 0; i < ENT_MAX; i++) {
+        f->entities[i] = entity_store(i)->count;
+        f->slots[i] = entity_store(i)->slotCount;
+        f->freeSlot[i] = entity_store(i)->freeSlot;
+    }
+    f->particles[0] = Game.scenary.explosions.count;
+    f->particles[1] = Game.scenary.debris.count;
+
+    f->size = rewind_walk(frame, SDL_TRUE);
+    return f->size;
+}
+
+// Keeps the freshly reset stage aside so a restart does not have to build
+// it again. The start frame sits at the top of the rewind buffer, which is
+// allocated once here, so a reset never allocates.
+static void rewind_mark_start(void) {
+    Rewind* rw = Game.rewind;
+    Uint32 size, end;
+
+    if (!rw->enabled) {
+        return;
+    }
+
+    if (rw->data == NULL) {
+        rw->data = MEM_ALLOC(MEM_REWIND, REWIND_BYTES);
+        if (rw->data == NULL) {
+            printf("Failed to allocate rewind buffer!\n");
+            sim_fail();
+        }
+        rw->end = REWIND_BYTES;
+    }
+
+    // Leave at least half the buffer to the frames
+    size = rewind_walk(NULL, SDL_TRUE);
+    if (size > REWIND_BYTES / 2) {
+        rw->start = NULL;
+        rw->end = REWIND_BYTES;
+        return;
+    }
+
+    // Frames the start frame grew over go. The newest frames end at head,
+    // the ones after it are the oldest.
+    end = REWIND_BYTES - size;
+    if (rw->head > end) {
+        rw->count = 0;
+        rw->head = 0;
+    } else if (end < rw->end) {
+        while (rw->count > 0 && rw->frames[rw->first] >= rw->head) {
+            rw->first = (rw->first + 1) % REWIND_TICKS;
+            rw->count--;
+        }
+    }
+
+    rw->end = end;
+    rw->start = rw->data + end;
+    rewind_save(rw->start);
+}
+
+static void rewind_quit(void) {
+    Rewind* rw = Game.rewind;
+
+    if (rw->captures > 0) {
+        SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO,
+            "Rewind holds %.1f s, captured %ld ticks of %.1f KB in %.1f us each, restored %ld restarted %ld",
+            (double)rw->count / FPS, rw->captures, rw->bytes / 1024.0 / rw->captures,
+            rw->captureTime * 1000000.0 / SDL_GetPerformanceFrequency() / rw->captures,
+            rw->restores, rw->restarts);
+    }
+
+    MEM_FREE(rw->data);
+    rw->data = NULL;
+    rw->start = NULL;
+    rw->count = 0;
+    rw->head = 0;
+    rw->end = 0;
+}
+
+static float lerp(float prev, float cur) {
+    return prev + (cur - prev) * Game.alpha;
+}
+
+// bench.c includes this file and brings its own main
+#ifndef TIGER_NO_MAIN
+
+// Replay file layout, all little endian:
+//   magic[4] version seed ticks hash         five 32 bit words
+//   (ticks since the last change, mask)...   varint pairs
+// The first change is counted from tick 0. ticks and hash are filled in
+// when the recording is closed.
+static void replay_record(const char* filename, Uint32 seed) {
+    Replay* rp = Game.replay;
+
+    rp->file = fopen(filename, "wb");
+    if (rp->file == NULL) {
+        printf("Failed to create replay %s!\n", filename);
+        exit(1);
+    }
+
+    fwrite(REPLAY_MAGIC, 1, 4, rp->file);
+    write_u32(rp->file, REPLAY_VERSION);
+    write_u32(rp->file, seed);
+    write_u32(rp->file, 0);
+    write_u32(rp->file, 0);
+
+    rp->recording = SDL_TRUE;
+    rp->seed = seed;
+}
+
+// Ticks the simulation back to back with nothing else in the way
+static void run_headless(long ticks) {
+    Uint64 start, end;
+    double seconds;
+    long i;
+
+    start = SDL_GetPerformanceCounter();
+
+    // --zero-alloc also publishes snapshots, so the run allocates all a
+    // played session would
+    for (i = 0; i < ticks && Game.running; i++) {
+        tick();
+        if (Game.memory->strict) {
+            snapshot_publish();
+        }
+    }
+
+    end = SDL_GetPerformanceCounter();
+    seconds = (double)(end - start) / SDL_GetPerformanceFrequency();
+
+    printf("ticks %ld seconds %.3f ticks/sec %.0f hash %08x\n",
+        i, seconds, seconds > 0 ? i / seconds : 0, state_hash());
+
+    if (Game.memory->strict) {
+        printf("zero-alloc %ld ticks after warm-up, %ld stage resets, none allocated\n",
+            MAX(i - MEM_WARMUP_TICKS, 0), Game.resets);
+    }
+}
+
+// Shows the loading screen while the workers decode the stage's assets.
+// Anything found in the asset pack is resident right away.
+static void loader_start(void) {
+    Loader* loader = Game.loader;
+    int i;
+
+    loader->delegate = (Delegate) { loading_logic, loading_draw };
+    loader->next = Game.delegate;
+    loader->active = SDL_TRUE;
+    loader->total = SPR_MAX + 1 + SND_MAX + 1;
+    Game.delegate = &loader->delegate;
+
+    memset(Game.sounds->sounds, 0, sizeof(Mix_Chunk*) * SND_MAX);
+    Game.sounds->music = NULL;
+
+    if (pack_load_atlas()) {
+        SDL_AtomicAdd(&loader->loaded, SPR_MAX + 1);
+    } else {
+        loader->pageSize = atlas_page_size();
+        for (i = 0; i < SPR_MAX; i++) {
+            Game.jobs->submit(&loader->pending, load_sprite_job, loader, i, i + 1);
+        }
+    }
+
+    // SDL_mixer's loaders share state, every sound and the music load on
+    // one worker
+    if (pack_load_sounds()) {
+        SDL_AtomicAdd(&loader->loaded, SND_MAX);
+        Game.jobs->submit(&loader->pending, load_audio_job, loader, SND_MAX, SND_MAX);
+    } else {
+        Game.jobs->submit(&loader->pending, load_audio_job, loader, 0, SND_MAX);
+    }
+}
+
+// Reports time to the first frame, and to the first frame of gameplay
+static void loader_frame(void) {
+    Loader* loader = Game.loader;
+    Uint64 frequency = SDL_GetPerformanceFrequency();
+
+    if (loader->firstFrame == 0) {
+        loader->firstFrame = SDL_GetPerformanceCounter();
+    }
+
+    if (loader->active || loader->firstGameFrame != 0) {
+        return;
+    }
+
+    loader->firstGameFrame = SDL_GetPerformanceCounter();
+
+    printf("First frame after %.1f ms, gameplay after %.1f ms\n",
+        (double)(loader->firstFrame - loader->start) * 1000 / frequency,
+        (double)(loader->firstGameFrame - loader->start) * 1000 / frequency);
+}
+
+// Runs on the render thread each frame. Once the sprites are decoded the
+// atlas is packed on a worker, once that is done the pages are uploaded
+// here and the stage starts.
+static void loading_logic(void) {
+    Loader* loader = Game.loader;
+    Atlas* atlas = &Game.graphics->atlas;
+
+    if (SDL_AtomicGet(&loader->pending) > 0) {
+        return;
+    }
+
+    // The jobs that failed said why, exiting is up to this thread as
+    // Game.quit joins the workers and tears down the renderer
+    if (SDL_AtomicGet(&loader->failed)) {
+        printf("Failed to load the stage!\n");
+        exit(1);
+    }
+
+    if (atlas->pageCount == 0 && !loader->packing) {
+        loader->packing = SDL_TRUE;
+        Game.jobs->submit(&loader->pending, load_atlas_job, loader, 0, 1);
+        return;
+    }
+
+    if (atlas->surfaces[0] != NULL) {
+        atlas_upload();
+        SDL_AtomicAdd(&loader->loaded, 1);
+    }
+
+    loader->active = SDL_FALSE;
+    Game.delegate = loader->next;
+    Game.stage->init_stage();
+
+    SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO,
+        "Loaded %d assets in %.1f ms", loader->total,
+        (double)(SDL_GetPerformanceCounter() - loader->start) * 1000 / SDL_GetPerformanceFrequency());
+
+    sim_start();
+}
+
+static void loading_draw(void) {
+    Loader* loader = Game.loader;
+    SDL_Rect frame = { Game.screen->w / 4, Game.screen->h / 2 - 8, Game.screen->w / 2, 16 };
+    SDL_Rect bar = { frame.x + 2, frame.y + 2, 0, frame.h - 4 };
+
+    bar.w = (frame.w - 4) * SDL_AtomicGet(&loader->loaded) / loader->total;
+
+    render_color(0x80, 0x80, 0x80, 0xFF);
+    render_rect(&frame);
+    render_color(0xFF, 0xFF, 0xFF, 0xFF);
+    render_fill_rect(&bar);
+}
+
+static void load_sprite_job(void* data, int start, int end) {
+    Loader* loader = data;
+    int i;
+
+    for (i = start; i < end; i++) {
+        loader->images[i] = load_surface(spriteFiles[i]);
+        if (loader->images[i] == NULL) {
+            SDL_AtomicSet(&loader->failed, 1);
+            return;
+        }
+        SDL_AtomicAdd(&loader->loaded, 1);
+    }
+}
+
+// Sounds start..end, then the stage music
+static void load_audio_job(void* data, int start, int end) {
+    Loader* loader = data;
+    int i;
+
+    for (i = start; i < end; i++) {
+        if (!load_sound(i)) {
+            SDL_AtomicSet(&loader->failed, 1);
+            return;
+        }
+        SDL_AtomicAdd(&loader->loaded, 1);
+    }
+
+    Game.sounds->music = Mix_LoadMUS(STAGE_MUSIC);
+    SDL_AtomicAdd(&loader->loaded, 1);
+}
+
+static void load_atlas_job(void* data, int start, int end) {
+    Loader* loader = data;
+
+    if (!atlas_pack_images(loader->images, loader->pageSize)) {
+        SDL_AtomicSet(&loader->failed, 1);
+    }
+}
+
+// Only needed when present does not wait for vsync, keeps the render loop
+// from spinning faster than MAX_RENDER_FPS
+static void capFrameRate(Uint64 frameStart) {
+    Uint64 frequency = SDL_GetPerformanceFrequency();
+    Uint64 frameTime = SDL_GetPerformanceCounter() - frameStart;
+    Uint64 target = frequency / MAX_RENDER_FPS;
+
+    if (Game.vsync || frameTime >= target) {
+        return;
+    }
+
+    SDL_Delay((target - frameTime) * 1000 / frequency);
+}
+
+// Publishes the current state, then ticks on its own thread at FPS for as
+// long as the game runs
+static void sim_start(void) {
+    snapshot_publish();
+
+    Game.snapshots->thread = SDL_CreateThread(sim_thread, "simulation", NULL);
+    if (Game.snapshots->thread == NULL) {
+        printf("Failed to create simulation thread! SDL Error %s\n", SDL_GetError());
+        exit(1);
+    }
+}
+
+static int sim_thread(void* data) {
+    Uint64 frequency = SDL_GetPerformanceFrequency();
+    Uint64 step = frequency / FPS;
+    Uint64 next = SDL_GetPerformanceCounter();
+    Uint64 now;
+
+    // The simulation takes over the main thread's job queue
+    SDL_TLSSet(Game.jobs->self, (void*)(intptr_t)1, NULL);
+    Game.snapshots->threadId = SDL_ThreadID();
+
+    while (!SDL_AtomicGet(&Game.snapshots->quit)) {
+        now = SDL_GetPerformanceCounter();
+        if (now < next) {
+            SDL_Delay((next - now) * 1000 / frequency);
+            continue;
+        }
+
+        // A long stall drops ticks instead of trying to catch up all at once
+        if (now - next > step * MAX_TICKS_PER_FRAME) {
+            next = now;
+        }
+
+        tick();
+        snapshot_publish();
+        next += step;
+    }
+
+    return 0;
+}
+
+// Puts the simulation back to a saved frame. New stars get a new
+// generation so the renderer draws them again.
+static void rewind_load(Uint8* frame) {
+    RewindFrame* f = (RewindFrame*)frame;
+
+    rngState = f->rngState;
+    backgroundX = f->backgroundX;
+    enemySpawnTimer = f->enemySpawnTimer;
+    stageResetTimer = f->stageResetTimer;
+    Game.stage->score = f->score;
+    highscore = f->highscore;
+    Game.entities.player = f->player;
+    memcpy(Game.scenary.starOffset, f->starOffset, sizeof(f->starOffset));
+
+    if (memcmp(Game.scenary.stars, f->stars, sizeof(f->stars)) != 0) {
+        memcpy(Game.scenary.stars, f->stars, sizeof(f->stars));
+        Game.scenary.starGeneration++;
+    }
+
+    rewind_walk(frame, SDL_FALSE);
+}
+
+// Goes back to the state of ago ticks before the newest frame, or the
+// oldest one held. Newer frames are dropped, play continues from there.
+static SDL_bool rewind_restore(int ago) {
+    Rewind* rw = Game.rewind;
+
+    if (rw->count == 0) {
+        return SDL_FALSE;
+    }
+
+    rw->count = MAX(rw->count - ago, 1);
+    rw->head = rw->frames[(rw->first + rw->count - 1) % REWIND_TICKS];
+    rewind_load(rw->data + rw->head);
+    rw->head += ((RewindFrame*)(rw->data + rw->head))->size;
+    rw->restores++;
+
+    return SDL_TRUE;
+}
+
+// Saves this tick's state as the newest frame
+static void rewind_capture(void) {
+    Rewind* rw = Game.rewind;
+    Uint64 start = SDL_GetPerformanceCounter();
+    Uint32 size, oldest;
+
+    if (!rw->enabled) {
+        return;
+    }
+
+    // Nothing is kept before the stage first starts
+    if (rw->data == NULL) {
+        return;
+    }
+
+    size = rewind_walk(NULL, SDL_TRUE);
+    if (size > rw->end) {
+        rw->count = 0;
+        return;
+    }
+
+    // Frames left past the end are the oldest, they go before starting
+    // over at the front
+    if (rw->head + size > rw->end) {
+        while (rw->count > 0 && rw->frames[rw->first] >= rw->head) {
+            rw->first = (rw->first + 1) % REWIND_TICKS;
+            rw->count--;
+        }
+        rw->head = 0;
+    }
+
+    while (rw->count > 0) {
+        oldest = rw->frames[rw->first];
+        if (rw->count < REWIND_TICKS && (oldest < rw->head || oldest >= rw->head + size)) {
+            break;
+        }
+        rw->first = (rw->first + 1) % REWIND_TICKS;
+        rw->count--;
+    }
+
+    rw->frames[(rw->first + rw->count) % REWIND_TICKS] = rw->head;
+    rw->count++;
+    rw->head += rewind_save(rw->data + rw->head);
+
+    rw->captures++;
+    rw->bytes += size;
+    rw->captureTime += SDL_GetPerformanceCounter() - start;
+}
+
+// Holding backspace plays the last seconds backwards, F5 restarts the
+// stage from the state it started in. Returns SDL_TRUE when the tick was
+// spent on either.
+static SDL_bool rewind_tick(void) {
+    Rewind* rw = Game.rewind;
+    int* keyboard = Game.input->keyboard;
+    SDL_bool restart = keyboard[SDL_SCANCODE_F5] && !rw->restartHeld;
+
+    rw->restartHeld = keyboard[SDL_SCANCODE_F5];
+
+    if (!rw->enabled) {
+        return SDL_FALSE;
+    }
+
+    if (restart && rw->start != NULL) {
+        rewind_load(rw->start);
+        Game.sounds->stop_sounds();
+        rw->restarts++;
+        return SDL_TRUE;
+    }
+
+    // What was playing when the rewind started fades into the background
+    if (keyboard[SDL_SCANCODE_BACKSPACE] && !rw->rewindHeld) {
+        Game.sounds->volume_sounds(SND_REWIND_VOLUME);
+    }
+    rw->rewindHeld = keyboard[SDL_SCANCODE_BACKSPACE];
+
+    if (keyboard[SDL_SCANCODE_BACKSPACE]) {
+        return rewind_restore(REWIND_SPEED);
+    }
+
+    return SDL_FALSE;
+}
+
+// Closes the tick's allocation count. Warm-up ends after
+// MEM_WARMUP_TICKS, from then on --zero-alloc aborts on any allocation.
+static void mem_tick(void) {
+    Memory* mem = Game.memory;
+
+    SDL_AtomicLock(&mem->lock);
+
+    mem->maxTickAllocs = MAX(mem->maxTickAllocs, mem->tickAllocs);
+    if (mem->ticks >= MEM_WARMUP_TICKS && mem->tickAllocs > 0) {
+        mem->steadyTicks++;
+    }
+    mem->tickAllocs = 0;
+
+    if (++mem->ticks == MEM_WARMUP_TICKS && mem->strict) {
+        mem->armed = SDL_TRUE;
+    }
+
+    SDL_AtomicUnlock(&mem->lock);
+}
+
+// One CSV row per presented frame goes to filename
+static void render_stats_open(const char* filename) {
+    RenderStats* stats = &Game.graphics->stats;
+
+    stats->csv = fopen(filename, "w");
+    if (stats->csv == NULL) {
+        printf("Failed to create %s!\n", filename);
+        exit(1);
+    }
+
+    fprintf(stats->csv, "frame,draw_calls,quads,texture_switches,blend_switches,state_changes,sort_spared_textures,sort_spared_blends\n");
+}
+
+// One fixed step of the simulation, always 1/FPS of a second of game time
+static void tick(void) {
+
+    input_sample();
+
+    if (rewind_tick()) {
+        mem_tick();
+        return;
+    }
+
+    Entity* player = get_player();
+
+    if (player != NULL && player->heath <= 0) {
+        entity_kill(entity_store(ENT_PLAYER), player);
+    }
+
+    if (get_player() == NULL && --stageResetTimer <= 0) {
+        Game.stage->reset_stage();
+        Game.resets++;
+    };
+
+    Game.delegate->logic();
+    Game.sounds->flush_sounds();
+
+    rewind_capture();
+    mem_tick();
+}
+
+int main(int argc, char* argv[]) {
+
+    Uint64 frequency, step;
+    Uint32 seed = SDL_GetTicks() ^ (Uint32)time(NULL);
+    Snapshot* snap;
+    const char* record = NULL;
+    const char* replay = NULL;
+    long headlessTicks = 0;
+    int i;
+
+    // Time to first frame counts from here
+    Game.loader->start = SDL_GetPerformanceCounter();
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--headless") == 0 && i + 1 < argc) {
+            Game.headless = SDL_TRUE;
+            headlessTicks = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay = argv[++i];
+        } else if (strcmp(argv[i], "--mixer") == 0) {
+            Game.audio->enabled = SDL_TRUE;
+        } else if (strcmp(argv[i], "--zero-alloc") == 0) {
+            Game.memory->strict = SDL_TRUE;
+        } else if (strcmp(argv[i], "--render-stats") == 0 && i + 1 < argc) {
+            render_stats_open(argv[++i]);
+        } else {
+            printf("Usage: %s [--headless TICKS] [--seed N] [--record FILE | --replay FILE] [--mixer] [--zero-alloc] [--render-stats FILE]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    if (record != NULL && replay != NULL) {
+        printf("Can not record and replay at the same time!\n");
+        exit(1);
+    }
+
+    if (record != NULL) {
+        replay_record(record, seed);
+    }
+
+    // A replay brings its own seed, and headless 0 plays all of it
+    if (replay != NULL) {
+        seed = replay_play(replay);
+        if (headlessTicks <= 0) {
+            headlessTicks = Game.replay->ticks;
+        }
+    }
+
+    rng_seed(seed);
+
+    // Rewinding would throw a replay off, and headless runs have nobody
+    // to press the keys. Headless --zero-alloc still keeps the frames so
+    // the check covers the rewind buffer too.
+    Game.rewind->enabled = (!Game.headless || Game.memory->strict) && record == NULL && replay == NULL;
+
+    Game.init();
     // Make sure to clean up all resources before exit
     atexit(Game.quit);
 
-    Game.sounds->init_sounds();
-    Game.stage->init_stage();
+    if (Game.headless) {
+        Game.stage->init_stage();
+        printf("seed %u\n", seed);
+        run_headless(headlessTicks);
+        return 0;
+    }
+
+    frequency = SDL_GetPerformanceFrequency();
+    step = frequency / FPS;
 
-    then = SDL_GetTicks();
-    remainder = 0;
+    // Once the loader is done the simulation runs on its own thread, this
+    // one only handles events and draws the newest snapshot
+    loader_start();
 
     while (Game.running) {
 
         Uint64 start = SDL_GetPerformanceCounter();
 
+        Game.profiler->begin_frame();
+
         // Handle inputs from the SDL's queue
-        Game.prepare_scene();
-        Game.input->do_input();
+        PROFILE_ZONE(ZONE_DO_INPUT, Game.input->do_input());
+
+        // The simulation thread said why it stopped, see sim_fail
+        if (SDL_AtomicGet(&Game.snapshots->failed)) {
+            exit(1);
+        }
 
+        if (Game.loader->active) {
+            Game.delegate->logic();
+        }
 
-        if (Game.entities.player != NULL && Game.entities.player->heath <= 0) {
-            Game.entities.player = NULL;
+        // Draw the newest tick interpolated from the one before by how
+        // long ago it finished
+        if (!Game.loader->active) {
+            snap = snapshot_acquire();
+            Game.alpha = MIN((float)(SDL_GetPerformanceCounter() - snap->time) / step, 1.0f);
         }
 
-        if (Game.entities.player == NULL && --stageResetTimer <= 0) {
-            Game.stage->reset_stage();
-        };
+        PROFILE_ZONE(ZONE_PREPARE_SCENE, Game.prepare_scene());
+        Game.delegate->draw();
+        PROFILE_ZONE(ZONE_PRESENT_SCENE, Game.present_scene());
 
-            Game.delegate->logic();
-            Game.delegate->draw();
+        loader_frame();
 
-        Game.present_scene();
-        capFrameRate(&then, &remainder);
+        PROFILE_ZONE(ZONE_CAP_FRAME_RATE, capFrameRate(start));
+        Game.profiler->end_frame();
         Uint64 end = SDL_GetPerformanceCounter();
-        Game.elapsed = 1.0f / ((end - start) / (float)SDL_GetPerformanceFrequency());
+        Game.elapsed = 1.0f / ((end - start) / (float)frequency);
     };
 
     return 0;
 }
+#endif
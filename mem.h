@@ -0,0 +1,11 @@
+enum {
+    MEM_BATCH,
+    MEM_TEXT,
+    MEM_ENTITIES,
+    MEM_PARTICLES,
+    MEM_GRID,
+    MEM_BULLETS,
+    MEM_SNAPSHOTS,
+    MEM_REWIND,
+    MEM_MAX
+};
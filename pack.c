@@ -0,0 +1,132 @@
+// Bakes the sprites in gfx/ and the sounds in sfx/ into ASSET_PACK, already
+// packed into atlas pages and decoded to the mixer's PCM format, so the
+// game can map it and start without decoding anything.
+//
+// gcc -Wall pack.c -o pack -I./include -L./lib -lSDL2main -lSDL2 -lSDL2_image -lSDL2_mixer && ./pack
+
+// Only the loaders are needed, TIGER_PACK leaves out what only the game
+// and the bench use
+#define TIGER_NO_MAIN
+#define TIGER_PACK
+#include "main.c"
+
+static Uint32 pack_align(Uint32 offset) {
+    return (offset + PACK_ALIGN - 1) & ~(Uint32)(PACK_ALIGN - 1);
+}
+
+static void pack_write(FILE* file, const void* data, size_t size, const char* filename) {
+    if (fwrite(data, 1, size, file) != size) {
+        printf("Failed to write %s!\n", filename);
+        exit(1);
+    }
+}
+
+static void pack_pad(FILE* file, Uint32 offset, const char* filename) {
+    static const Uint8 zeros[PACK_ALIGN];
+    pack_write(file, zeros, pack_align(offset) - offset, filename);
+}
+
+int main(int argc, char* argv[]) {
+    const char* filename = argc > 1 ? argv[1] : ASSET_PACK;
+    Atlas* atlas = &Game.graphics->atlas;
+    PackHeader header = { .version = PACK_VERSION };
+    PackPage pages[ATLAS_MAX_PAGES] = {};
+    PackSprite sprites[SPR_MAX];
+    PackSound sounds[SND_MAX];
+    SDL_Surface* surface;
+    Uint16 format;
+    Uint32 offset;
+    FILE* file;
+    int i, y;
+
+    // Nothing is shown or played, the mixer only has to convert the sounds
+    SDL_setenv("SDL_AUDIODRIVER", "dummy", 1);
+
+    if (SDL_Init(SDL_INIT_AUDIO) != 0) {
+        printf("Failed to initialize SDL! SDL Error %s\n", SDL_GetError());
+        exit(1);
+    }
+
+    if (Mix_OpenAudio(AUDIO_FREQUENCY, MIX_DEFAULT_FORMAT, AUDIO_CHANNELS, AUDIO_CHUNK_SIZE) == -1) {
+        printf("Failed to initialize Open Audio! SDL Error %s\n", SDL_GetError());
+        exit(1);
+    }
+
+    Mix_QuerySpec(&header.frequency, &format, &header.channels);
+    header.format = format;
+
+    atlas_pack(ATLAS_PAGE_SIZE);
+    load_sound_files();
+
+    memcpy(header.magic, PACK_MAGIC, 4);
+    header.pages = atlas->pageCount;
+    header.sprites = SPR_MAX;
+    header.sounds = SND_MAX;
+
+    offset = pack_align(sizeof(header) + sizeof(PackPage) * header.pages + sizeof(sprites) + sizeof(sounds));
+
+    for (i = 0; i < atlas->pageCount; i++) {
+        pages[i].w = atlas->pageW[i];
+        pages[i].h = atlas->pageH[i];
+        pages[i].offset = offset;
+        pages[i].size = pages[i].w * pages[i].h * 4;
+        offset = pack_align(offset + pages[i].size);
+    }
+
+    for (i = 0; i < SPR_MAX; i++) {
+        sprites[i].page = atlas->sprites[i].page;
+        sprites[i].rect = atlas->sprites[i].rect;
+    }
+
+    for (i = 0; i < SND_MAX; i++) {
+        sounds[i].offset = offset;
+        sounds[i].size = Game.sounds->sounds[i]->alen;
+        offset = pack_align(offset + sounds[i].size);
+    }
+
+    file = fopen(filename, "wb");
+    if (file == NULL) {
+        printf("Failed to open %s for writing!\n", filename);
+        exit(1);
+    }
+
+    pack_write(file, &header, sizeof(header), filename);
+    pack_write(file, pages, sizeof(PackPage) * header.pages, filename);
+    pack_write(file, sprites, sizeof(sprites), filename);
+    pack_write(file, sounds, sizeof(sounds), filename);
+    pack_pad(file, ftell(file), filename);
+
+    // Surface rows can be padded, the pack's are not
+    for (i = 0; i < atlas->pageCount; i++) {
+        surface = atlas->surfaces[i];
+        SDL_LockSurface(surface);
+        for (y = 0; y < surface->h; y++) {
+            pack_write(file, (Uint8*)surface->pixels + y * surface->pitch, surface->w * 4, filename);
+        }
+        SDL_UnlockSurface(surface);
+        pack_pad(file, ftell(file), filename);
+    }
+
+    for (i = 0; i < SND_MAX; i++) {
+        pack_write(file, Game.sounds->sounds[i]->abuf, sounds[i].size, filename);
+        pack_pad(file, ftell(file), filename);
+    }
+
+    if (fclose(file) != 0) {
+        printf("Failed to write %s!\n", filename);
+        exit(1);
+    }
+
+    printf("Packed %d sprites in %d page(s) and %d sounds into %s, %u bytes\n",
+        SPR_MAX, atlas->pageCount, SND_MAX, filename, offset);
+
+    atlas_destroy();
+    for (i = 0; i < SND_MAX; i++) {
+        Mix_FreeChunk(Game.sounds->sounds[i]);
+    }
+
+    Mix_CloseAudio();
+    SDL_Quit();
+
+    return 0;
+}
@@ -0,0 +1,25 @@
+enum {
+    ZONE_DO_INPUT,
+    ZONE_DO_PLAYER,
+    ZONE_DO_ENEMIES,
+    ZONE_SIM_JOBS,
+    ZONE_DO_BULLETS,
+    ZONE_DO_ENEMY_BULLETS,
+    ZONE_DO_EXPLOSIONS,
+    ZONE_DO_DEBRIS,
+    ZONE_SPAWN_ENEMY,
+    ZONE_SNAPSHOT,
+    ZONE_PREPARE_SCENE,
+    ZONE_DRAW_BACKGROUND,
+    ZONE_DRAW_STARFIELD,
+    ZONE_DRAW_PLAYER,
+    ZONE_DRAW_BULLETS,
+    ZONE_DRAW_ENEMY_BULLETS,
+    ZONE_DRAW_ENEMY,
+    ZONE_DRAW_DEBRIS,
+    ZONE_DRAW_EXPLOSIONS,
+    ZONE_DRAW_HUD,
+    ZONE_PRESENT_SCENE,
+    ZONE_CAP_FRAME_RATE,
+    ZONE_MAX
+};
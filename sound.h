@@ -1,7 +1,15 @@
 enum {
     CH_ANY = -1,
     CH_PLAYER,
-    CH_ALIEN_FIRE
+    CH_ALIEN_FIRE,
+    CH_MAX
+};
+
+// Commands the game sends the --mixer engine
+enum {
+    AUDIO_PLAY,
+    AUDIO_STOP,
+    AUDIO_VOLUME
 };
 
 enum {
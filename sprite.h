@@ -0,0 +1,10 @@
+enum {
+    SPR_PLAYER,
+    SPR_PLAYER_BULLET,
+    SPR_ENEMY,
+    SPR_ENEMY_BULLET,
+    SPR_BACKGROUND,
+    SPR_EXPLOSION,
+    SPR_FONT,
+    SPR_MAX
+};
@@ -2,30 +2,59 @@
 #include <SDL2/SDL_rect.h>
 #include <SDL2/SDL_render.h>
 #include <SDL2/SDL_mixer.h>
+#include <SDL2/SDL_atomic.h>
+#include <SDL2/SDL_thread.h>
 #include "defs.h"
 #include "sound.h"
+#include "sprite.h"
+#include "profile.h"
+#include "layer.h"
+#include "entity.h"
+#include "mem.h"
 
-typedef struct Entity Entity;
+typedef Uint32 EntityHandle;
 
 typedef struct {
     void (*logic)(void);
     void (*draw)(void);
 } Delegate;
 
-typedef struct Entity {
+typedef struct {
     float x;
     float y;
     int w;
     int h;
     float dx;
     float dy;
+    // Position at the start of the last tick, drawn interpolated towards x/y
+    float prevX;
+    float prevY;
     int heath;
     int reload;
-    SDL_Texture* texture;
-    Entity* next;
+    int sprite;
+    EntityHandle handle;
 
 } Entity;
 
+// Where a sprite lives in the atlas, w and h are the sprite's own size
+typedef struct {
+    const char* filename;
+    int page;
+    SDL_Rect rect;
+    SDL_BlendMode blend;
+} Sprite;
+
+// Every sprite packed into as few page textures as fit the renderer's
+// maximum texture size. Pages are built as surfaces first, then uploaded.
+typedef struct {
+    Sprite sprites[SPR_MAX];
+    SDL_Surface* surfaces[ATLAS_MAX_PAGES];
+    SDL_Texture* pages[ATLAS_MAX_PAGES];
+    int pageW[ATLAS_MAX_PAGES];
+    int pageH[ATLAS_MAX_PAGES];
+    int pageCount;
+} Atlas;
+
 typedef struct {
         unsigned int w;
         unsigned int h;
@@ -35,70 +64,336 @@ typedef struct {
 
 } Screen;
 
+// A run of quads recorded with the same draw layer, blend mode and
+// texture. The key packs them with the order the state was first used in
+// its layer, so sorting by it groups the run with every other run of the
+// same state in the layer.
+typedef struct {
+    Uint32 key;
+    int first;
+    int quads;
+} DrawCommand;
+
+// Quads recorded for the frame. Colors ride on the vertices, so tinting a
+// sprite does not start a new command. The commands are sorted by key
+// when the batch is flushed and each run of equal state goes to the
+// renderer in one SDL_RenderGeometry call.
+typedef struct {
+    // State the next quads are recorded with
+    SDL_Texture* texture;
+    int textureW;
+    int textureH;
+    SDL_BlendMode blend;
+    int layer;
+    Uint32 key;
+
+    // Textures and blend modes recorded since the last flush, the key
+    // holds their index
+    SDL_Texture* textures[DRAW_MAX_TEXTURES];
+    SDL_BlendMode blends[DRAW_MAX_BLENDS];
+    int textureCount;
+    int blendCount;
+    // Keys of the states drawn since the last flush, in the order they
+    // were first drawn. DRAW_IN_ORDER layers add one for every command.
+    Uint32 states[DRAW_MAX_STATES];
+    int stateCount;
+
+    SDL_Vertex* vertices;
+    int* indices;
+    int quads;
+    int capacity;
+
+    DrawCommand* commands;
+    DrawCommand* sorted;
+    int commandCount;
+
+    // SDL_RenderGeometry calls made and quads they carried
+    long flushes;
+    long submitted;
+    // Texture and blend mode changes after sorting, and the ones drawing
+    // in recorded order would have made
+    long textureChanges;
+    long blendChanges;
+    long unsortedTextureChanges;
+    long unsortedBlendChanges;
+} SpriteBatch;
+
+// A layer drawn into its own render target. It is redrawn when the key it
+// was drawn with changes or the renderer loses its targets.
+typedef struct {
+    const char* name;
+    SDL_Texture* texture;
+    // Size of the render target
+    int w;
+    int h;
+    SDL_BlendMode blend;
+    Uint64 key;
+    SDL_bool valid;
+
+    long rebuilds;
+    long composites;
+} CachedLayer;
+
+// Renderer work of one frame, counted by the render_* wrappers. A switch
+// is a draw call using another texture or blend mode than the one before,
+// primitives draw without a texture.
+typedef struct {
+    long drawCalls;
+    long quads;
+    long textureSwitches;
+    long blendSwitches;
+    // Draw colors, blend modes and render targets set
+    long stateChanges;
+    // Switches sorting the batch spared
+    long sortedTextureSwitches;
+    long sortedBlendSwitches;
+} RenderFrame;
+
+typedef struct {
+    RenderFrame current;
+    RenderFrame last;
+    RenderFrame total;
+    // The frame with the most draw calls
+    RenderFrame peak;
+    long frames;
+
+    // What the last draw call drew with
+    SDL_Texture* texture;
+    SDL_BlendMode blend;
+    SDL_BlendMode drawBlend;
+    // Batch totals at the end of the last frame
+    long batchTextureSpared;
+    long batchBlendSpared;
+
+    SDL_bool visible;
+    FILE* csv;
+} RenderStats;
+
 typedef struct {
-    SDL_Texture* (*load_texture)(const char* filename);
-    void (*blit)(SDL_Texture *texture, int x, int y);
-    void (*blitRect)(SDL_Texture* texture, SDL_Rect* src, int x, int y);
+    void (*load_atlas)(void);
+    void (*blit)(int sprite, int x, int y);
+    void (*blitRect)(int sprite, SDL_Rect* src, int x, int y);
+    void (*blitColor)(int sprite, SDL_Rect* src, int x, int y, SDL_Color color);
+    void (*flush)(void);
+
+    Atlas atlas;
+    SpriteBatch batch;
+    CachedLayer caches[CACHE_MAX];
+    // Where drawing goes back to once a cached layer is redrawn
+    SDL_Texture* target;
+    RenderStats stats;
 
 } Graphics;
 
+typedef struct {
+    long requested;
+    long played;
+    long merged;
+    long dropped;
+} SoundStats;
+
 typedef struct {
     Mix_Chunk* sounds[SND_MAX];
     void (*init_sounds)(void);
     void (*load_sounds)(void);
     void (*play_sound)(int, int);
 
+    // Requests of the current tick, started by flush_sounds
+    int pending[SND_MAX];
+    int channels[SND_MAX];
+    void (*flush_sounds)(void);
+    void (*stop_sounds)(void);
+    void (*volume_sounds)(int);
+    SoundStats stats;
+
     Mix_Music* music;
     void (*load_music)(char*);
     void (*play_music)(int);
 
 } Sounds;
 
+typedef struct {
+    int type;
+    int channel;
+    int volume;
+    // PCM in the device's format, for AUDIO_PLAY
+    const Sint16* samples;
+    Uint32 length;
+} AudioCommand;
+
+// Owned by the audio thread, length and position count samples
+typedef struct {
+    const Sint16* samples;
+    Uint32 length;
+    Uint32 position;
+    int volume;
+} AudioVoice;
+
+// Optional replacement for SDL_mixer's channels, mixed in its post mix
+// callback. The game thread is the only writer of head, the audio thread
+// the only writer of tail, so neither ever waits on the other.
+typedef struct {
+    SDL_bool enabled;
+    AudioCommand commands[AUDIO_RING_SIZE];
+    SDL_atomic_t head;
+    SDL_atomic_t tail;
+    AudioVoice voices[AUDIO_VOICES];
+
+    long sent;
+    long full;
+    SDL_atomic_t dropped;
+} Audio;
+
+// A formatted line laid out as font quads relative to where it is drawn
+typedef struct {
+    char text[MAX_LINE_LENGTH];
+    Uint32 hash;
+    SDL_Color color;
+
+    SDL_Vertex* vertices;
+    int quads;
+    int capacity;
+
+    long lastUsed;
+} TextRun;
+
 typedef struct {
     char drawTextBuffer[MAX_LINE_LENGTH];
+
+    // Least recently drawn line is rebuilt when a new one comes along
+    TextRun runs[TEXT_CACHE_SIZE];
+    long clock;
+    long hits;
+    long builds;
+
     void (*draw_text)(int, int, int, int, int, char*, ...);
 } Text;
 
 typedef struct{
+    // What the simulation sees, copied from held at the start of each tick
     int keyboard[MAX_KEYBOARD_KEYS];
     void (*do_input)(void);
     void (*do_key_up)(SDL_KeyboardEvent* event);
     void (*do_key_down)(SDL_KeyboardEvent* event);
+    // Written by key events on the main thread
+    int held[MAX_KEYBOARD_KEYS];
+    SDL_SpinLock lock;
 
 } Input;
 
 
-typedef struct Explosion Explosion;
-typedef struct Explosion {
-    float x;
-    float y;
-    float dx;
-    float dy;
-    int r, g, b, a;
-    Explosion *next;
-} Explosion;
+// Explosions and debris are kept as structure-of-arrays so the per tick
+// integrate-and-expire pass streams through contiguous floats. Particles
+// die when life runs out and are removed by moving the last one into
+// their slot, so order is not preserved.
+typedef struct {
+    float* x;
+    float* y;
+    // Position before the last tick, for interpolated drawing
+    float* px;
+    float* py;
+    float* dx;
+    float* dy;
+    // Ticks left to live; explosions also use it as their alpha
+    float* life;
 
-typedef struct Debris Debris;
-typedef struct Debris {
-    float x;
-    float y;
-    float dx;
-    float dy;
-    SDL_Rect rect;
-    SDL_Texture *texture;
-    int life;
-    Debris *next;
-} Debris;
+    // Per particle draw data, only touched when drawing or moving slots
+    SDL_Color* color;
+    SDL_Rect* rect;
+    int* sprite;
+
+    int count;
+    int capacity;
+
+    // Added to dy every tick
+    float gravity;
+
+    // Set by integrate jobs when any particle in their slice died
+    SDL_atomic_t dead;
+
+} Particles;
+
+typedef struct {
+    // Entities alive now and the most ever alive at once
+    int live;
+    int peak;
+    int capacity;
+    long spawns;
+    long kills;
+} EntityStats;
+
+// Every entity of one kind, packed at the front of entities in no
+// particular order. A handle names a slot and the slot knows where its
+// entity is, so a kill moves the last entity into the hole and every
+// handle stays good. A killed entity's handle no longer matches its
+// slot's generation and looks up as NULL.
+typedef struct {
+    const char* name;
+    Entity* entities;
+    int count;
+    int capacity;
+
+    // Dense index of each slot's entity, or the next free slot
+    int* slots;
+    Uint16* generations;
+    int slotCount;
+    int freeSlot;
+
+    EntityStats stats;
+} EntityStore;
+
+typedef struct {
+    // Narrow phase tests run and skipped, since start and for the last build
+    long tests;
+    long avoided;
+    long frameTests;
+    long frameAvoided;
+} GridStats;
 
+// Uniform grid over the play field, rebuilt from an entity list each tick.
+// Every cell an entity overlaps gets a link in that cell's chain; entities
+// outside the field are clamped into the border cells.
 typedef struct {
-    Entity playerHead, *playerTail;
-    Entity playerBulletHead, *playerBulletTail;
-    Entity enemyHead, *enemyTail;
-    Entity enemyBulletHead, *enemyBulletTail;
+    // First link of each cell's chain, -1 when the cell is empty
+    int cells[GRID_ROWS * GRID_COLS];
 
-    Explosion explosionHead, *explosionTail;
-    Debris debrisHead, *debrisTail;
+    // One link per (entity, cell) pair, items index the store's entities,
+    // so lower items come first
+    EntityStore* store;
+    int* items;
+    int* next;
+    int count;
+    int capacity;
 
+    // Top left cell of the entity's span, a query only tests an entity in
+    // the first cell their spans share so it is tested once. Queries never
+    // write to the grid and can run on any number of threads.
+    int* spanX;
+    int* spanY;
+
+    // Entities in the grid
+    int entities;
+
+    GridStats stats;
+} Grid;
+
+// A tick of one kind of bullet, split in two. Jobs move disjoint slices of
+// bullets and look up what each one hits; then one thread applies the hits
+// in order and removes the bullets.
+typedef struct {
+    EntityStore* bullets;
+    EntityStore* targets;
+    // Index of the target each bullet hit, -1 for none
+    int* hits;
+    int count;
+    int capacity;
+
+    Grid* grid;
+    SDL_bool collide;
+    SDL_atomic_t tests;
+} BulletPass;
+
+typedef struct {
     int score;
     void (*init_stage)(void);
     void (*reset_stage)(void);
@@ -112,3 +407,307 @@ typedef struct {
 
 } Star;
 
+typedef struct {
+    // Counter ticks spent in each zone, summed over every tick of the frame
+    Uint64 zones[ZONE_MAX];
+    Uint64 total;
+} ProfileFrame;
+
+typedef struct {
+    // Ring of finished frames, head is where the next one goes
+    ProfileFrame frames[PROFILE_FRAMES];
+    int head;
+    int count;
+    ProfileFrame current;
+    Uint64 frameStart;
+    Uint64 zoneStart[ZONE_MAX];
+    Uint64 frequency;
+    SDL_bool visible;
+    // Zones timed on the simulation thread, handed over with each snapshot
+    ProfileFrame sim;
+    SDL_threadID renderThread;
+    void (*begin_frame)(void);
+    void (*end_frame)(void);
+    void (*draw)(void);
+} Profiler;
+
+
+typedef void (*JobFunction)(void* data, int start, int end);
+
+typedef struct {
+    JobFunction fn;
+    void* data;
+    int start;
+    int end;
+    // Decremented once the job has run
+    SDL_atomic_t* pending;
+} Job;
+
+// Owner pushes and pops at the bottom, other workers steal from the top
+typedef struct {
+    Job jobs[JOB_QUEUE_SIZE];
+    int top;
+    int bottom;
+    SDL_SpinLock lock;
+} JobQueue;
+
+typedef struct {
+    // Queue 0 belongs to the thread running the simulation, which runs
+    // jobs while it waits
+    JobQueue queues[JOB_MAX_WORKERS];
+    SDL_Thread* threads[JOB_MAX_WORKERS];
+    int workers;
+    SDL_sem* wake;
+    SDL_atomic_t quit;
+    SDL_TLSID self;
+
+    SDL_atomic_t executed;
+    SDL_atomic_t stolen;
+
+    void (*submit)(SDL_atomic_t*, JobFunction, void*, int, int);
+    void (*parallel_for)(SDL_atomic_t*, JobFunction, void*, int, int);
+    void (*wait)(SDL_atomic_t*);
+} Jobs;
+
+// One sprite as the simulation left it, drawn interpolated from px,py to x,y
+typedef struct {
+    int sprite;
+    // Part of the sprite to draw, all of it when w is 0
+    SDL_Rect rect;
+    float px;
+    float py;
+    float x;
+    float y;
+    SDL_Color color;
+} SnapQuad;
+
+// Everything the renderer needs from one tick. Owned by one thread at a
+// time, the simulation fills it in and the renderer only reads it.
+typedef struct {
+    SnapQuad* quads;
+    int count;
+    int capacity;
+    // Quads of a layer run from layers[layer] up to layers[layer + 1]
+    int layers[LAYER_MAX + 1];
+
+    int backgroundX;
+    int starOffset[STAR_SPEEDS];
+    // Stars are only copied in when the stage reset them
+    int starGeneration;
+    Star stars[MAX_STARS];
+
+    int score;
+    int highscore;
+
+    // Counter time the tick finished, rendering interpolates from there
+    Uint64 time;
+    Uint64 tick;
+    ProfileFrame zones;
+} Snapshot;
+
+// Lock-free triple buffer between the simulation and render threads. Each
+// side owns one snapshot, the third is swapped through middle, which has
+// SNAPSHOT_FRESH set until the renderer picks it up.
+typedef struct {
+    Snapshot buffers[3];
+    SDL_atomic_t middle;
+    int back;
+    int front;
+
+    SDL_Thread* thread;
+    SDL_atomic_t quit;
+    // Set by the simulation thread itself, see sim_fail
+    SDL_threadID threadId;
+    // The simulation hit a failure it could not exit on, main() does
+    SDL_atomic_t failed;
+
+    long published;
+    long dropped;
+} Snapshots;
+
+// Input of a session, one key bitmask per tick, stored as the ticks at
+// which the mask changed. Together with the seed that replays it exactly.
+typedef struct {
+    FILE* file;
+    SDL_bool recording;
+    SDL_bool playing;
+
+    Uint32 seed;
+    // Ticks in the recording, and the state hash after the last of them
+    Uint32 ticks;
+    Uint32 hash;
+
+    Uint32 tick;
+    Uint32 mask;
+    // Tick of the last change written, or of the next change to apply
+    Uint32 changeTick;
+    Uint32 changeMask;
+} Replay;
+
+// Fixed size part of a rewind frame, the stores and particles follow it as
+// flat arrays. Nothing in a frame points anywhere, restoring it is only
+// copies.
+typedef struct {
+    Uint32 size;
+
+    Uint32 rngState;
+    int backgroundX;
+    int enemySpawnTimer;
+    int stageResetTimer;
+    int score;
+    int highscore;
+    EntityHandle player;
+    int starOffset[STAR_SPEEDS];
+    Star stars[MAX_STARS];
+
+    // Entities, slots and free slot of each store
+    int entities[ENT_MAX];
+    int slots[ENT_MAX];
+    int freeSlot[ENT_MAX];
+    // Explosions, then debris
+    int particles[2];
+} RewindFrame;
+
+// Frames of the last ticks, laid end to end in one preallocated buffer.
+// A frame that does not fit before the end starts over at the front, the
+// oldest frames in its way are dropped.
+typedef struct {
+    SDL_bool enabled;
+    Uint8* data;
+    // Offset of each frame held, the oldest at first
+    Uint32 frames[REWIND_TICKS];
+    int first;
+    int count;
+    Uint32 head;
+    // Frames go below end, the start frame takes the rest of the buffer
+    Uint32 end;
+
+    // State right after the stage was last reset, for instant restarts
+    Uint8* start;
+    int restartHeld;
+    int rewindHeld;
+
+    long captures;
+    long restores;
+    long restarts;
+    Uint64 bytes;
+    Uint64 captureTime;
+} Rewind;
+
+// Sits in front of every heap block main.c hands out, so a free knows
+// what it gives back
+typedef struct {
+    size_t size;
+    int tag;
+} MemHeader;
+
+typedef struct {
+    size_t live;
+    size_t peak;
+    long allocs;
+    long frees;
+} MemTag;
+
+// One line of main.c that allocates
+typedef struct {
+    int line;
+    int tag;
+    long allocs;
+    size_t bytes;
+} MemSite;
+
+// Heap use of main.c by tag and by call site. Both threads allocate, the
+// lock covers the counters.
+typedef struct {
+    SDL_SpinLock lock;
+    MemTag tags[MEM_MAX];
+    MemSite sites[MEM_SITES];
+    size_t live;
+    size_t peak;
+
+    // Allocations in the tick so far, the most any tick made, and ticks
+    // past warm-up that allocated at all
+    long tickAllocs;
+    long maxTickAllocs;
+    long steadyTicks;
+    long ticks;
+
+    // Abort on any allocation once warm-up is over, see --zero-alloc
+    SDL_bool strict;
+    SDL_bool armed;
+} Memory;
+
+// Decodes the stage's assets on the job workers while the loading screen
+// runs as the delegate, then hands over to gameplay. Workers only decode,
+// textures are created on the render thread.
+typedef struct {
+    Delegate delegate;
+    Delegate* next;
+    SDL_bool active;
+
+    SDL_Surface* images[SPR_MAX];
+    int pageSize;
+    SDL_bool packing;
+    SDL_atomic_t pending;
+    // Assets resident so far out of total, atlas pages count as one
+    SDL_atomic_t loaded;
+    int total;
+    // Set by a job that could not load its asset, the job has printed why
+    // and loading_logic exits on the render thread
+    SDL_atomic_t failed;
+
+    // Counter at startup, and when the loading screen and gameplay first
+    // showed
+    Uint64 start;
+    Uint64 firstFrame;
+    Uint64 firstGameFrame;
+} Loader;
+
+// On-disk layout of the asset pack pack.c bakes, in native byte order.
+// The header is followed by the page, sprite and sound tables, offsets
+// count from the start of the file and are PACK_ALIGN aligned.
+typedef struct {
+    char magic[4];
+    Uint32 version;
+    Uint32 pages;
+    Uint32 sprites;
+    Uint32 sounds;
+    // Format the sounds were decoded to, the mixer has to match it
+    Sint32 frequency;
+    Uint32 format;
+    Sint32 channels;
+} PackHeader;
+
+// RGBA32 pixels, w * 4 bytes a row
+typedef struct {
+    Uint32 w;
+    Uint32 h;
+    Uint32 offset;
+    Uint32 size;
+} PackPage;
+
+typedef struct {
+    Uint32 page;
+    SDL_Rect rect;
+} PackSprite;
+
+// PCM in the mixer's format
+typedef struct {
+    Uint32 offset;
+    Uint32 size;
+} PackSound;
+
+// The asset pack mapped read only for the whole session. Textures are
+// filled and chunks point straight from the mapping.
+typedef struct {
+    Uint8* data;
+    size_t size;
+    // File mapping handle on Windows
+    void* handle;
+    SDL_bool opened;
+
+    const PackHeader* header;
+    const PackPage* pages;
+    const PackSprite* sprites;
+    const PackSound* sounds;
+} Pack;